@@ -0,0 +1,310 @@
+// Measures the cost of Lurien's instrumentation and how the sampler scales.
+// Results are written to stdout as JSON so that they can be tracked between
+// releases. Build with optimisations enabled for meaningful numbers.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define LURIEN_ENABLED
+#include "lurien/lurien.h"
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+constexpr int kMaxDepth = 64;
+
+// Counts outputs and remembers when the last one arrived, so that the cost
+// of reporting can be measured.
+class CountingReceiver : public lurien::OutputReceiver
+{
+public:
+  void HandleOutput(const lurien::ThreadOutput&) const override
+  {
+    last_output_ns_.store(
+      Clock::now().time_since_epoch().count(), std::memory_order_release);
+    outputs_.fetch_add(1, std::memory_order_release);
+  }
+
+  std::uint64_t Outputs() const { return outputs_.load(); }
+  std::int64_t LastOutputNs() const { return last_output_ns_.load(); }
+
+private:
+  mutable std::atomic<std::uint64_t> outputs_ = 0;
+  mutable std::atomic<std::int64_t> last_output_ns_ = 0;
+};
+
+CountingReceiver* receiver;
+
+struct Result
+{
+  std::string name_;
+  std::uint64_t iterations_;
+  double value_;
+  std::string unit_;
+};
+
+std::vector<Result> results;
+
+void Report(
+  const std::string& name,
+  std::uint64_t iterations,
+  double value,
+  const std::string& unit = "ns")
+{
+  results.push_back(Result { name, iterations, value, unit });
+}
+
+double NanosecondsSince(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+    .count();
+}
+
+// Every thread which uses Lurien is reported when it exits.
+std::uint64_t threads_started = 0;
+
+void WaitForReports()
+{
+  while (receiver->Outputs() < threads_started)
+  {
+    std::this_thread::yield();
+  }
+}
+
+void EmptyScope()
+{
+  LURIEN_SCOPE(empty)
+}
+
+void Nest(int depth)
+{
+  LURIEN_SCOPE(nested)
+  if (depth > 1)
+  {
+    Nest(depth - 1);
+  }
+}
+
+void BenchmarkEmptyScope()
+{
+  constexpr std::uint64_t iterations = 10000000;
+
+  // Make sure that the path exists before timing.
+  EmptyScope();
+
+  const auto start = Clock::now();
+  for (std::uint64_t i = 0; i < iterations; i++)
+  {
+    EmptyScope();
+  }
+
+  Report("empty_scope", iterations, NanosecondsSince(start) / iterations);
+}
+
+// The cost of a scope while recording is paused.
+void BenchmarkPausedScope()
+{
+  constexpr std::uint64_t iterations = 10000000;
+
+  LURIEN_PAUSE
+
+  const auto start = Clock::now();
+  for (std::uint64_t i = 0; i < iterations; i++)
+  {
+    EmptyScope();
+  }
+
+  const double elapsed_ns = NanosecondsSince(start);
+
+  LURIEN_RESUME
+
+  Report("paused_scope", iterations, elapsed_ns / iterations);
+}
+
+void BenchmarkNestedScopes()
+{
+  for (int depth = 1; depth <= kMaxDepth; depth *= 2)
+  {
+    const std::uint64_t iterations = 4000000 / depth;
+
+    Nest(depth);
+
+    const auto start = Clock::now();
+    for (std::uint64_t i = 0; i < iterations; i++)
+    {
+      Nest(depth);
+    }
+
+    Report(
+      "nested_scopes/" + std::to_string(depth),
+      iterations,
+      NanosecondsSince(start) / (iterations * depth));
+  }
+}
+
+// Every scope in a new thread is being entered for the first time, so this
+// measures the cost of adding a node.
+void BenchmarkFirstEntry()
+{
+  constexpr std::uint64_t threads = 200;
+
+  double total_ns = 0;
+  for (std::uint64_t i = 0; i < threads; i++)
+  {
+    ++threads_started;
+    std::thread([&total_ns] {
+      // Create this thread's data first so that it isn't timed.
+      EmptyScope();
+
+      const auto start = Clock::now();
+      Nest(kMaxDepth);
+      total_ns += NanosecondsSince(start);
+    }).join();
+  }
+
+  const std::uint64_t scopes = threads * kMaxDepth;
+  Report("first_entry", scopes, total_ns / scopes);
+}
+
+// Run many threads at once while the sampler visits all of them, and
+// measure both the cost of a scope and whether the sampler keeps up.
+void BenchmarkThreads()
+{
+  for (int thread_count = 1; thread_count <= 256; thread_count *= 4)
+  {
+    constexpr std::uint64_t iterations = 200000;
+
+    const auto stats_before = lurien::GetStats();
+    const auto start = Clock::now();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; i++)
+    {
+      ++threads_started;
+      threads.emplace_back([] {
+        for (std::uint64_t j = 0; j < iterations; j++)
+        {
+          Nest(4);
+        }
+      });
+    }
+
+    for (auto& thread : threads)
+    {
+      thread.join();
+    }
+
+    const double elapsed_ns = NanosecondsSince(start);
+    const auto stats_after = lurien::GetStats();
+
+    const std::string suffix = "/" + std::to_string(thread_count);
+    Report(
+      "threads_scope" + suffix,
+      iterations * thread_count,
+      elapsed_ns / (iterations * thread_count * 4));
+
+    const std::uint64_t sampler_iterations =
+      stats_after.sampler_iterations_ - stats_before.sampler_iterations_;
+    if (sampler_iterations > 0)
+    {
+      Report(
+        "threads_sampling_interval" + suffix,
+        sampler_iterations,
+        elapsed_ns / sampler_iterations);
+      Report(
+        "threads_sampler_pass_time" + suffix,
+        sampler_iterations,
+        double((stats_after.sampler_pass_time_ -
+                stats_before.sampler_pass_time_).count()) /
+          sampler_iterations);
+    }
+  }
+}
+
+// Measure how long a thread takes to exit, and how long it then takes for
+// its output to be reported.
+void BenchmarkTeardown()
+{
+  constexpr std::uint64_t threads = 200;
+
+  double exit_ns = 0;
+  double report_ns = 0;
+  for (std::uint64_t i = 0; i < threads; i++)
+  {
+    WaitForReports();
+
+    ++threads_started;
+    Clock::time_point finished;
+    std::thread([&finished] {
+      Nest(kMaxDepth);
+      finished = Clock::now();
+    }).join();
+
+    exit_ns += NanosecondsSince(finished);
+
+    WaitForReports();
+
+    report_ns +=
+      receiver->LastOutputNs() - finished.time_since_epoch().count();
+  }
+
+  Report("thread_exit", threads, exit_ns / threads);
+  Report("thread_report", threads, report_ns / threads);
+}
+
+void PrintResults()
+{
+  std::cout << "{\n  \"benchmarks\": [\n";
+  for (std::size_t i = 0; i < results.size(); i++)
+  {
+    const Result& result = results[i];
+    std::cout << "    {\"name\": \"" << result.name_ << "\", "
+              << "\"iterations\": " << result.iterations_ << ", "
+              << "\"value\": " << result.value_ << ", "
+              << "\"unit\": \"" << result.unit_ << "\"}"
+              << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+
+  std::cout << "  ]\n}\n";
+}
+
+}
+
+// The number of sampling threads can be given as an argument.
+int main(int argc, char** argv)
+{
+  auto counting_receiver = std::make_unique<CountingReceiver>();
+  receiver = counting_receiver.get();
+
+  // Give every nesting level its own node.
+  lurien::Options options;
+  options.recursion = lurien::RecursionMode::Expand;
+  options.max_scope_depth = kMaxDepth;
+  if (argc > 1)
+  {
+    options.sampling_threads = std::stoul(argv[1]);
+  }
+
+  LURIEN_INIT(std::move(counting_receiver), options);
+
+  BenchmarkEmptyScope();
+  BenchmarkPausedScope();
+  BenchmarkNestedScopes();
+  BenchmarkFirstEntry();
+  BenchmarkThreads();
+  BenchmarkTeardown();
+
+  LURIEN_STOP
+
+  PrintResults();
+
+  return 0;
+}
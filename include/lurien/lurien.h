@@ -1,303 +1,5079 @@
 #ifndef __LURIEN_PROFILER_H__
 #define __LURIEN_PROFILER_H__
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
-#include <functional>
+#include <cstdlib>
+#include <istream>
+#include <iterator>
 #include <list>
+#include <map>
 #include <memory>
+#include <new>
 #include <mutex>
+#include <optional>
 #include <ostream>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <variant>
 #include <vector>
 
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LURIEN_HAS_RDTSC
+#endif
+
+#if defined(__linux__)
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Older glibc versions don't expose this field under its documented name.
+#if !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
 namespace lurien
 {
 
-struct ScopeOutput;
+struct ScopeOutput;
+
+// Scope names are interned in a process-wide table and identified by their
+// index in it. This marks a name which hasn't been interned.
+constexpr std::uint32_t kNoScopeName = ~std::uint32_t(0);
+
+struct Options;
+
+namespace details
+{
+
+inline std::uint32_t RegisterScopeName(std::string_view name);
+inline const Options& ActiveOptions();
+inline bool UsingSignalBackend();
+
+} // details
+
+// A log-linear histogram of durations in nanoseconds. Each power of two is
+// split into kSubBuckets linear buckets, so a recorded value is known to
+// within 1/kSubBuckets of itself whatever its magnitude, and the number of
+// buckets is fixed. Histograms from different threads can be merged.
+class LatencyHistogram
+{
+public:
+  static constexpr int kSubBucketBits = 4;
+  static constexpr std::uint64_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr std::size_t kBuckets =
+    (64 - kSubBucketBits + 1)*kSubBuckets;
+
+  inline LatencyHistogram();
+
+  inline static std::size_t BucketIndex(std::uint64_t value);
+
+  // The largest value which is counted in a bucket.
+  inline static std::uint64_t BucketUpperBound(std::size_t index);
+
+  inline void Record(std::uint64_t nanoseconds, std::uint64_t count = 1);
+  inline void Merge(const LatencyHistogram& other);
+
+  // The smallest duration which at least the given percentage of recorded
+  // durations did not exceed, e.g. Percentile(99) for p99.
+  inline std::chrono::nanoseconds Percentile(double percentage) const;
+
+  std::uint64_t Count() const { return count_; }
+  std::uint64_t BucketCount(std::size_t index) const
+  {
+    return counts_[index];
+  }
+
+private:
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t count_ = 0;
+};
+
+inline LatencyHistogram::LatencyHistogram() : counts_(kBuckets)
+{
+}
+
+inline std::size_t LatencyHistogram::BucketIndex(std::uint64_t value)
+{
+  // Small values get a bucket each.
+  if (value < kSubBuckets)
+  {
+    return std::size_t(value);
+  }
+
+  const int exponent = std::bit_width(value) - 1;
+  const int shift = exponent - kSubBucketBits;
+  const std::uint64_t sub_bucket = (value >> shift) - kSubBuckets;
+  return std::size_t((shift + 1)*kSubBuckets + sub_bucket);
+}
+
+inline std::uint64_t LatencyHistogram::BucketUpperBound(std::size_t index)
+{
+  if (index < kSubBuckets)
+  {
+    return index;
+  }
+
+  const int shift = int(index / kSubBuckets) - 1;
+  const std::uint64_t sub_bucket = index % kSubBuckets;
+  const std::uint64_t lower = (kSubBuckets + sub_bucket) << shift;
+  return lower + ((std::uint64_t(1) << shift) - 1);
+}
+
+inline void LatencyHistogram::Record(
+  std::uint64_t nanoseconds,
+  std::uint64_t count)
+{
+  counts_[BucketIndex(nanoseconds)] += count;
+  count_ += count;
+}
+
+inline void LatencyHistogram::Merge(const LatencyHistogram& other)
+{
+  for (std::size_t i = 0; i < kBuckets; i++)
+  {
+    counts_[i] += other.counts_[i];
+  }
+
+  count_ += other.count_;
+}
+
+inline std::chrono::nanoseconds LatencyHistogram::Percentile(
+  double percentage) const
+{
+  const double rank = std::ceil(percentage / 100 * double(count_));
+  const std::uint64_t target = std::max(std::uint64_t(rank), std::uint64_t(1));
+
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBuckets; i++)
+  {
+    seen += counts_[i];
+    if (seen >= target)
+    {
+      return std::chrono::nanoseconds(std::int64_t(BucketUpperBound(i)));
+    }
+  }
+
+  return std::chrono::nanoseconds(0);
+}
+
+// Hardware performance counter totals, from Options::hardware_counters.
+// Counters which the hardware or the kernel's perf_event_paranoid setting
+// doesn't allow are left at zero. Only user space is counted.
+struct HardwareCounters
+{
+  std::uint64_t cycles_ = 0;
+  std::uint64_t instructions_ = 0;
+  std::uint64_t cache_misses_ = 0;
+  std::uint64_t branch_misses_ = 0;
+
+  double InstructionsPerCycle() const
+  {
+    return cycles_ > 0 ? double(instructions_) / cycles_ : 0;
+  }
+
+  // Misses per thousand instructions.
+  double CacheMissRate() const
+  {
+    return instructions_ > 0 ? 1000.0 * cache_misses_ / instructions_ : 0;
+  }
+
+  double BranchMissRate() const
+  {
+    return instructions_ > 0 ? 1000.0 * branch_misses_ / instructions_ : 0;
+  }
+
+  inline HardwareCounters& operator+=(const HardwareCounters& other);
+};
+
+inline HardwareCounters& HardwareCounters::operator+=(
+  const HardwareCounters& other)
+{
+  cycles_ += other.cycles_;
+  instructions_ += other.instructions_;
+  cache_misses_ += other.cache_misses_;
+  branch_misses_ += other.branch_misses_;
+  return *this;
+}
+
+struct OutputNode
+{
+  std::list<ScopeOutput> scope_outputs_;
+};
+
+struct ScopeOutput : OutputNode
+{
+  std::string name_;
+
+  // The interned id of the name, which is the same in every thread.
+  std::uint32_t name_id_ = kNoScopeName;
+
+  // Self samples were taken in this scope but not in any scope inside it,
+  // while inclusive samples also count those in inner scopes. Proportions
+  // are of the thread's total samples: cpu_proportion_ is inclusive.
+  std::uint64_t self_samples_;
+  std::uint64_t inclusive_samples_;
+  double self_proportion_;
+  double cpu_proportion_;
+
+  // How many times this scope was re-entered while it was already active
+  // and the recursive call was folded into this node.
+  std::uint64_t recursive_calls_;
+
+  // These are only measured for timed scopes (see LURIEN_TIMED_SCOPE). The
+  // total excludes the time of recursive calls, which is already included
+  // in the outer call.
+  std::uint64_t calls_;
+  std::chrono::nanoseconds total_time_;
+  std::chrono::nanoseconds max_time_;
+
+  // The distribution of the timed calls' durations, if
+  // Options::latency_histograms is set.
+  std::optional<LatencyHistogram> latency_;
+
+  // Counts from Options::hardware_counters if they could be opened for the
+  // thread. These are attributed whenever the thread enters or exits a
+  // scope, so unlike samples they are exact.
+  std::optional<HardwareCounters> self_counters_;
+  std::optional<HardwareCounters> inclusive_counters_;
+
+  // The operator new calls made and operator delete calls made directly in
+  // this scope, if LURIEN_ALLOCATION_HOOKS is defined, with the bytes which
+  // were asked for.
+  std::uint64_t allocations_;
+  std::uint64_t allocated_bytes_;
+  std::uint64_t deallocations_;
+};
+
+enum class OutputKind
+{
+  // The thread has exited and the output covers its whole lifetime.
+  ThreadExit,
+
+  // The thread is still running and the output only covers the samples
+  // taken since the previous snapshot of it.
+  Snapshot
+};
+
+// Measurements of Lurien's own overhead.
+struct Stats
+{
+  // The sampling interval which was asked for and the mean interval which
+  // was actually achieved. With several sampling threads this is the
+  // slowest one's.
+  std::chrono::nanoseconds requested_sampling_interval_;
+  std::chrono::nanoseconds achieved_sampling_interval_;
+
+  // How many times the slowest sampling thread has visited its threads, and
+  // the total time all of the sampling threads have spent doing so.
+  std::uint64_t sampler_iterations_;
+  std::chrono::nanoseconds sampler_pass_time_;
+
+  // How many times a thread starting or exiting had to wait for the lock on
+  // the list of threads. The sampling thread never takes this lock.
+  std::uint64_t sampler_lock_contentions_;
+};
+
+struct ThreadOutput : OutputNode
+{
+  std::thread::id thread_id_;
+
+  // The operating system's ID for the thread where there is one. Unlike
+  // thread_id_ this survives being written to a file.
+  std::uint64_t native_thread_id_;
+
+  // The name given by LURIEN_THREAD_NAME or, failing that, the name the
+  // operating system has for the thread. Tags are set by LURIEN_THREAD_TAG.
+  std::string thread_name_;
+  std::map<std::string, std::string> tags_;
+
+  OutputKind kind_;
+  std::uint64_t total_samples_;
+
+  // The mean time between samples which the sampling thread achieved. This
+  // can be used to convert sample counts into wall clock time.
+  std::chrono::nanoseconds sampling_interval_;
+
+  // How many times this thread has entered or exited a scope.
+  std::uint64_t scope_transitions_;
+
+  // How many scope entries and exits were left out of the trace because the
+  // thread's trace buffer was full (see Options::trace_output).
+  std::uint64_t dropped_trace_events_;
+
+  // This is only filled in if Options::report_stats is set.
+  std::optional<Stats> stats_;
+};
+
+enum class SamplingBackend
+{
+  // Sampling threads (one unless Options::sampling_threads says otherwise)
+  // periodically sample every thread. This measures wall clock time.
+  Thread,
+
+  // Each thread has a CPU time timer which interrupts it with SIGPROF and it
+  // samples itself in the signal handler. This measures CPU time and is
+  // only available on Linux: elsewhere it falls back to Thread.
+  Signal
+};
+
+// How a scope is treated by SetScopeFilter.
+enum class FilterMode : std::uint8_t
+{
+  // The scope is recorded as normal.
+  None,
+
+  // The scope itself is not recorded, so its samples are attributed to the
+  // enclosing scope, but scopes inside it still are.
+  Scope,
+
+  // Neither the scope nor anything inside it is recorded.
+  Subtree
+};
+
+enum class RecursionMode
+{
+  // Re-entering a scope which is already active is attributed to the
+  // existing node for that scope and counted as a recursive call.
+  Collapse,
+
+  // Every level of recursion gets its own node, down to
+  // Options::max_scope_depth after which deeper scopes are attributed to
+  // the deepest node.
+  Expand
+};
+
+// Settings which can be passed to LURIEN_INIT.
+struct Options
+{
+  // How long to wait between samples. Zero means sample continuously (or as
+  // fast as the timer allows when using the signal backend).
+  std::chrono::nanoseconds sampling_interval = std::chrono::milliseconds(1);
+
+  SamplingBackend backend = SamplingBackend::Thread;
+
+  // How many threads take the samples with the thread backend. Each samples
+  // an equal share of the running threads, so that the interval can be kept
+  // up with hundreds of them.
+  std::size_t sampling_threads = 1;
+
+  // On Linux, the CPUs to pin the sampling threads to, which are assigned in
+  // turn, and a SCHED_FIFO priority to run them at if this is non-zero. These
+  // are silently skipped if they aren't permitted.
+  std::vector<int> sampling_cpus;
+  int sampling_priority = 0;
+
+  RecursionMode recursion = RecursionMode::Collapse;
+  std::uint32_t max_scope_depth = 64;
+
+  // If this is non-zero then a snapshot of every running thread is reported
+  // at this interval.
+  std::chrono::nanoseconds snapshot_interval = std::chrono::nanoseconds(0);
+
+  // Rather than reporting each thread separately, merge threads' scope
+  // trees by path. Exiting threads are merged as they are reported and the
+  // result is output when Lurien is stopped; snapshots are merged across
+  // all running threads.
+  bool aggregate_threads = false;
+
+  // When aggregating, only merge threads which have the same name and
+  // report each name separately.
+  bool group_by_thread_name = false;
+
+  // Merge exiting threads which have the same name rather than reporting
+  // each one, and report the merged threads at every snapshot as well as
+  // when Lurien is stopped. Each report only covers what the threads did
+  // since they were last snapshotted, so nothing is reported twice. This
+  // keeps the output small when threads come and go often.
+  bool merge_exited_threads = false;
+
+  // Include Lurien's overhead statistics in each thread's output.
+  bool report_stats = false;
+
+  // Start with recording paused until SetEnabled(true) or LURIEN_RESUME.
+  bool start_paused = false;
+
+  // If this is set then every scope entry and exit is also written to this
+  // stream as a Chrome trace (the JSON array format, which Perfetto and
+  // chrome://tracing both load). The stream must outlive Lurien. Each thread
+  // buffers trace_buffer_events events which the sampling thread drains:
+  // events which don't fit are dropped and counted rather than blocking.
+  std::ostream* trace_output = nullptr;
+  std::size_t trace_buffer_events = 1 << 16;
+
+  // On Linux, count cycles, instructions, cache misses and branch misses
+  // for each scope using perf_event_open. This adds a system call to every
+  // scope entry and exit, and is silently skipped if the counters can't be
+  // opened.
+  bool hardware_counters = false;
+
+  // Record a histogram of the durations of each timed scope. This costs
+  // several kilobytes for each timed scope node, allocated the first time
+  // it exits.
+  bool latency_histograms = false;
+
+  // On Linux, if this is set then profiles of the running threads are
+  // served on a Unix domain socket at this path for as long as Lurien is
+  // running. See the README for the requests it accepts.
+  std::string server_socket_path;
+};
+
+// A scope in the merged output of several threads.
+struct AggregateScopeOutput
+{
+  std::list<AggregateScopeOutput> scope_outputs_;
+  std::string name_;
+  std::uint32_t name_id_;
+
+  // The samples for this path summed over all threads, as proportions of
+  // the total samples taken from all threads.
+  std::uint64_t self_samples_;
+  std::uint64_t inclusive_samples_;
+  double self_proportion_;
+  double cpu_proportion_;
+
+  // How many of the threads this path appeared in.
+  std::size_t thread_count_;
+
+  // The distribution of each thread's cpu_proportion_ for this path,
+  // counting threads which never entered it as zero. A large spread shows
+  // that work is unevenly balanced between threads.
+  double min_proportion_;
+  double max_proportion_;
+  double mean_proportion_;
+  double stddev_proportion_;
+
+  // Timed scope measurements, summed over threads apart from the maximum.
+  std::uint64_t calls_;
+  std::chrono::nanoseconds total_time_;
+  std::chrono::nanoseconds max_time_;
+  std::optional<LatencyHistogram> latency_;
+  std::optional<HardwareCounters> self_counters_;
+  std::optional<HardwareCounters> inclusive_counters_;
+
+  // Allocations summed over threads.
+  std::uint64_t allocations_;
+  std::uint64_t allocated_bytes_;
+  std::uint64_t deallocations_;
+};
+
+struct AggregateOutput
+{
+  std::list<AggregateScopeOutput> scope_outputs_;
+
+  // The name shared by the threads, if Options::group_by_thread_name is set.
+  std::string thread_name_;
+
+  OutputKind kind_;
+  std::size_t thread_count_;
+  std::uint64_t total_samples_;
+
+  // The threads' sampling intervals averaged over their samples.
+  std::chrono::nanoseconds sampling_interval_;
+};
+
+struct OutputReceiver
+{
+public:
+  virtual ~OutputReceiver() = default;
+  virtual void HandleOutput(
+    const ThreadOutput&) const = 0;
+
+  // This is used instead of HandleOutput when Options::aggregate_threads or
+  // Options::merge_exited_threads is set. Unless it is overridden, the
+  // merged threads are passed to HandleOutput as if they were one thread,
+  // with their number in the "threads" tag.
+  inline virtual void HandleAggregateOutput(
+    const AggregateOutput& output) const;
+};
+
+// Merges the output of several threads by scope path.
+class Aggregator
+{
+public:
+  inline Aggregator();
+  inline void Add(const ThreadOutput& output);
+  // Merge the result of another aggregator, e.g. one read from a file.
+  inline void Add(const AggregateOutput& output);
+  inline AggregateOutput Result(OutputKind kind) const;
+  bool Empty() const { return thread_count_ == 0; }
+
+private:
+  // As in the per-thread arena, parents come before their children.
+  struct Node
+  {
+    std::string name_;
+    std::uint32_t name_id_;
+    std::size_t parent_;
+    std::uint64_t self_samples_ = 0;
+    std::uint64_t inclusive_samples_ = 0;
+    std::size_t thread_count_ = 0;
+    double min_proportion_ = 1;
+    double max_proportion_ = 0;
+    double sum_proportion_ = 0;
+    double sum_squared_proportion_ = 0;
+    std::uint64_t calls_ = 0;
+    std::chrono::nanoseconds total_time_ {};
+    std::chrono::nanoseconds max_time_ {};
+    std::optional<LatencyHistogram> latency_ = std::nullopt;
+    std::optional<HardwareCounters> self_counters_ = std::nullopt;
+    std::optional<HardwareCounters> inclusive_counters_ = std::nullopt;
+    std::uint64_t allocations_ = 0;
+    std::uint64_t allocated_bytes_ = 0;
+    std::uint64_t deallocations_ = 0;
+  };
+
+  // Add the timings, allocations and counters, which are merged the same
+  // way whether the scope came from a thread or from another aggregate.
+  template <typename Scope>
+  inline static void AddMeasurements(Node& node, const Scope& scope);
+
+  std::vector<Node> nodes_;
+  // Nodes are found by their parent's index and their name's id.
+  std::unordered_map<std::uint64_t, std::size_t> lookup_;
+  std::size_t thread_count_ = 0;
+  std::uint64_t total_samples_ = 0;
+  double sampled_nanoseconds_ = 0;
+};
+
+inline Aggregator::Aggregator()
+{
+  // The root.
+  nodes_.push_back(Node { "", kNoScopeName, 0 });
+}
+
+template <typename Scope>
+inline void Aggregator::AddMeasurements(Node& node, const Scope& scope)
+{
+  node.calls_ += scope.calls_;
+  node.total_time_ += scope.total_time_;
+  node.max_time_ = std::max(node.max_time_, scope.max_time_);
+  if (scope.latency_)
+  {
+    if (!node.latency_)
+    {
+      node.latency_.emplace();
+    }
+
+    node.latency_->Merge(*scope.latency_);
+  }
+
+  node.allocations_ += scope.allocations_;
+  node.allocated_bytes_ += scope.allocated_bytes_;
+  node.deallocations_ += scope.deallocations_;
+
+  if (scope.self_counters_ && scope.inclusive_counters_)
+  {
+    if (!node.self_counters_)
+    {
+      node.self_counters_.emplace();
+      node.inclusive_counters_.emplace();
+    }
+
+    *node.self_counters_ += *scope.self_counters_;
+    *node.inclusive_counters_ += *scope.inclusive_counters_;
+  }
+}
+
+inline void Aggregator::Add(const ThreadOutput& output)
+{
+  ++thread_count_;
+  total_samples_ += output.total_samples_;
+  sampled_nanoseconds_ +=
+    double(output.total_samples_) * output.sampling_interval_.count();
+
+  // Children are pushed in reverse so that they are visited, and so added,
+  // in their original order.
+  std::vector<std::pair<const ScopeOutput*, std::size_t>> pending;
+  for (auto it = output.scope_outputs_.rbegin();
+       it != output.scope_outputs_.rend();
+       ++it)
+  {
+    pending.emplace_back(&*it, 0);
+  }
+
+  while (!pending.empty())
+  {
+    const auto [scope, parent] = pending.back();
+    pending.pop_back();
+
+    // Outputs which weren't built by Lurien may not have interned names.
+    const std::uint32_t name_id = scope->name_id_ != kNoScopeName
+      ? scope->name_id_ : details::RegisterScopeName(scope->name_);
+
+    auto [it, inserted] = lookup_.try_emplace(
+      (std::uint64_t(parent) << 32) | name_id, nodes_.size());
+    if (inserted)
+    {
+      nodes_.push_back(Node { scope->name_, name_id, parent });
+    }
+
+    const std::size_t index = it->second;
+    // A thread which was never sampled counts as not using the scope,
+    // rather than poisoning the distribution with its undefined proportion.
+    const double proportion =
+      output.total_samples_ > 0 ? scope->cpu_proportion_ : 0;
+
+    Node& node = nodes_[index];
+    node.self_samples_ += scope->self_samples_;
+    node.inclusive_samples_ += scope->inclusive_samples_;
+    ++node.thread_count_;
+    node.min_proportion_ = std::min(node.min_proportion_, proportion);
+    node.max_proportion_ = std::max(node.max_proportion_, proportion);
+    node.sum_proportion_ += proportion;
+    node.sum_squared_proportion_ += proportion*proportion;
+    AddMeasurements(node, *scope);
+
+    for (auto it = scope->scope_outputs_.rbegin();
+         it != scope->scope_outputs_.rend();
+         ++it)
+    {
+      pending.emplace_back(&*it, index);
+    }
+  }
+}
+
+inline void Aggregator::Add(const AggregateOutput& output)
+{
+  thread_count_ += output.thread_count_;
+  total_samples_ += output.total_samples_;
+  sampled_nanoseconds_ +=
+    double(output.total_samples_) * output.sampling_interval_.count();
+
+  const double threads = double(output.thread_count_);
+
+  std::vector<std::pair<const AggregateScopeOutput*, std::size_t>> pending;
+  for (auto it = output.scope_outputs_.rbegin();
+       it != output.scope_outputs_.rend();
+       ++it)
+  {
+    pending.emplace_back(&*it, 0);
+  }
+
+  while (!pending.empty())
+  {
+    const auto [scope, parent] = pending.back();
+    pending.pop_back();
+
+    const std::uint32_t name_id = scope->name_id_ != kNoScopeName
+      ? scope->name_id_ : details::RegisterScopeName(scope->name_);
+
+    auto [it, inserted] = lookup_.try_emplace(
+      (std::uint64_t(parent) << 32) | name_id, nodes_.size());
+    if (inserted)
+    {
+      nodes_.push_back(Node { scope->name_, name_id, parent });
+    }
+
+    const std::size_t index = it->second;
+
+    // The merged distribution is rebuilt from the mean and variance, which
+    // already count the threads that never entered the path as zero. The
+    // minimum is only reported when every thread entered the path, and then
+    // it is exact.
+    const double mean = scope->mean_proportion_;
+    const double variance =
+      scope->stddev_proportion_*scope->stddev_proportion_;
+
+    Node& node = nodes_[index];
+    node.self_samples_ += scope->self_samples_;
+    node.inclusive_samples_ += scope->inclusive_samples_;
+    node.thread_count_ += scope->thread_count_;
+    node.min_proportion_ =
+      std::min(node.min_proportion_, scope->min_proportion_);
+    node.max_proportion_ =
+      std::max(node.max_proportion_, scope->max_proportion_);
+    node.sum_proportion_ += mean*threads;
+    node.sum_squared_proportion_ += (variance + mean*mean)*threads;
+    AddMeasurements(node, *scope);
+
+    for (auto it = scope->scope_outputs_.rbegin();
+         it != scope->scope_outputs_.rend();
+         ++it)
+    {
+      pending.emplace_back(&*it, index);
+    }
+  }
+}
+
+inline AggregateOutput Aggregator::Result(OutputKind kind) const
+{
+  AggregateOutput output;
+  output.kind_ = kind;
+  output.thread_count_ = thread_count_;
+  output.total_samples_ = total_samples_;
+  output.sampling_interval_ = std::chrono::nanoseconds(
+    total_samples_ > 0
+      ? std::int64_t(sampled_nanoseconds_ / total_samples_) : 0);
+
+  const double threads = double(thread_count_);
+  // Proportions are zero, rather than undefined, when nothing was sampled.
+  const double samples = double(std::max<std::uint64_t>(total_samples_, 1));
+
+  std::vector<std::list<AggregateScopeOutput>*> children(nodes_.size());
+  children[0] = &output.scope_outputs_;
+  for (std::size_t i = 1; i < nodes_.size(); i++)
+  {
+    const Node& node = nodes_[i];
+    const double mean = node.sum_proportion_ / threads;
+    const double variance =
+      std::max(node.sum_squared_proportion_ / threads - mean*mean, 0.0);
+
+    auto& siblings = *children[node.parent_];
+    siblings.push_back(AggregateScopeOutput {
+      {},
+      node.name_,
+      node.name_id_,
+      node.self_samples_,
+      node.inclusive_samples_,
+      double(node.self_samples_) / samples,
+      double(node.inclusive_samples_) / samples,
+      node.thread_count_,
+      node.thread_count_ < thread_count_ ? 0 : node.min_proportion_,
+      node.max_proportion_,
+      mean,
+      std::sqrt(variance),
+      node.calls_,
+      node.total_time_,
+      node.max_time_,
+      node.latency_,
+      node.self_counters_,
+      node.inclusive_counters_,
+      node.allocations_,
+      node.allocated_bytes_,
+      node.deallocations_ });
+    children[i] = &siblings.back().scope_outputs_;
+  }
+
+  return output;
+}
+
+inline void OutputReceiver::HandleAggregateOutput(
+  const AggregateOutput& output) const
+{
+  ThreadOutput thread {};
+  thread.native_thread_id_ = 0;
+  thread.thread_name_ = output.thread_name_;
+  thread.tags_["threads"] = std::to_string(output.thread_count_);
+  thread.kind_ = output.kind_;
+  thread.total_samples_ = output.total_samples_;
+  thread.sampling_interval_ = output.sampling_interval_;
+
+  std::vector<std::pair<const AggregateScopeOutput*, OutputNode*>> pending;
+  for (auto it = output.scope_outputs_.rbegin();
+       it != output.scope_outputs_.rend();
+       ++it)
+  {
+    pending.emplace_back(&*it, &thread);
+  }
+
+  while (!pending.empty())
+  {
+    const auto [scope, parent] = pending.back();
+    pending.pop_back();
+
+    ScopeOutput& folded = parent->scope_outputs_.emplace_back();
+    folded.name_ = scope->name_;
+    folded.name_id_ = scope->name_id_;
+    folded.self_samples_ = scope->self_samples_;
+    folded.inclusive_samples_ = scope->inclusive_samples_;
+    folded.self_proportion_ = scope->self_proportion_;
+    folded.cpu_proportion_ = scope->cpu_proportion_;
+    folded.calls_ = scope->calls_;
+    folded.total_time_ = scope->total_time_;
+    folded.max_time_ = scope->max_time_;
+    folded.latency_ = scope->latency_;
+    folded.self_counters_ = scope->self_counters_;
+    folded.inclusive_counters_ = scope->inclusive_counters_;
+    folded.allocations_ = scope->allocations_;
+    folded.allocated_bytes_ = scope->allocated_bytes_;
+    folded.deallocations_ = scope->deallocations_;
+
+    for (auto it = scope->scope_outputs_.rbegin();
+         it != scope->scope_outputs_.rend();
+         ++it)
+    {
+      pending.emplace_back(&*it, &folded);
+    }
+  }
+
+  HandleOutput(thread);
+}
+
+// This is the default receiver implementation which writes to an std::ostream.
+class DefaultOutputReceiver : public OutputReceiver
+{
+public:
+  DefaultOutputReceiver(std::ostream& out) : out_(out) {}
+  inline void HandleOutput(
+    const ThreadOutput& output) const;
+  inline void HandleAggregateOutput(
+    const AggregateOutput& output) const;
+
+private:
+  std::ostream& out_;
+  mutable std::mutex output_sync_;
+
+  inline static void PrintSubtree(
+    std::ostream& out,
+    const ScopeOutput& scope,
+    int depth);
+
+  inline static void PrintSubtree(
+    std::ostream& out,
+    const AggregateScopeOutput& scope,
+    int depth);
+
+  // This prints the timing, allocations and hardware counters where there
+  // are any.
+  template <typename Scope>
+  inline static void PrintTiming(std::ostream& out, const Scope& scope);
+
+  inline void Write(const std::ostringstream& buffer) const;
+};
+
+inline void DefaultOutputReceiver::HandleOutput(
+  const ThreadOutput& output) const
+{
+  // Format the whole thread's output before writing it so that the stream
+  // is only locked and flushed once.
+  std::ostringstream buffer;
+
+  buffer << std::hex << std::showbase;
+  buffer << "Thread ID: ";
+  if (output.thread_id_ != std::thread::id())
+  {
+    buffer << output.thread_id_;
+  }
+  else
+  {
+    // The output has been read back from a file.
+    buffer << output.native_thread_id_;
+  }
+
+  buffer << std::dec << std::noshowbase;
+  if (!output.thread_name_.empty())
+  {
+    buffer << " \"" << output.thread_name_ << '"';
+  }
+
+  for (const auto& [key, value] : output.tags_)
+  {
+    buffer << ' ' << key << '=' << value;
+  }
+
+  if (output.kind_ == OutputKind::Snapshot)
+  {
+    buffer << " (snapshot)";
+  }
+
+  buffer << '\n';
+
+  // Recursively print the output data.
+  for (const auto& child : output.scope_outputs_)
+  {
+    PrintSubtree(buffer, child, 0);
+  }
+
+  if (output.stats_)
+  {
+    const Stats& stats = *output.stats_;
+    buffer << "Scope transitions: " << output.scope_transitions_ << '\n'
+           << "Sampling interval: "
+           << stats.achieved_sampling_interval_.count() << "ns (requested "
+           << stats.requested_sampling_interval_.count() << "ns)\n"
+           << "Sampler iterations: " << stats.sampler_iterations_ << '\n'
+           << "Sampler pass time: "
+           << stats.sampler_pass_time_.count() << "ns\n"
+           << "Sampler lock contentions: "
+           << stats.sampler_lock_contentions_ << '\n'
+           << "Dropped trace events: "
+           << output.dropped_trace_events_ << '\n';
+  }
+
+  Write(buffer);
+}
+
+inline void DefaultOutputReceiver::HandleAggregateOutput(
+  const AggregateOutput& output) const
+{
+  std::ostringstream buffer;
+
+  buffer << "Aggregate of " << output.thread_count_ << " threads";
+  if (!output.thread_name_.empty())
+  {
+    buffer << " named \"" << output.thread_name_ << '"';
+  }
+
+  if (output.kind_ == OutputKind::Snapshot)
+  {
+    buffer << " (snapshot)";
+  }
+
+  buffer << '\n';
+
+  for (const auto& child : output.scope_outputs_)
+  {
+    PrintSubtree(buffer, child, 0);
+  }
+
+  Write(buffer);
+}
+
+template <typename Scope>
+inline void DefaultOutputReceiver::PrintTiming(
+  std::ostream& out,
+  const Scope& scope)
+{
+  if (scope.calls_ > 0)
+  {
+    out << " (calls " << scope.calls_
+        << " total " << scope.total_time_.count()
+        << "ns max " << scope.max_time_.count() << "ns";
+
+    if (scope.latency_ && scope.latency_->Count() > 0)
+    {
+      const LatencyHistogram& latency = *scope.latency_;
+      out << " p50 " << latency.Percentile(50).count()
+          << "ns p90 " << latency.Percentile(90).count()
+          << "ns p99 " << latency.Percentile(99).count()
+          << "ns p999 " << latency.Percentile(99.9).count() << "ns";
+    }
+
+    out << ")";
+  }
+
+  if (scope.allocations_ > 0 || scope.deallocations_ > 0)
+  {
+    out << " (allocations " << scope.allocations_
+        << " bytes " << scope.allocated_bytes_
+        << " deallocations " << scope.deallocations_ << ")";
+  }
+
+  // The rates are inclusive of inner scopes.
+  if (scope.inclusive_counters_)
+  {
+    const HardwareCounters& counters = *scope.inclusive_counters_;
+    out << " (ipc " << counters.InstructionsPerCycle()
+        << " cache-mpki " << counters.CacheMissRate()
+        << " branch-mpki " << counters.BranchMissRate() << ")";
+  }
+}
+
+inline void DefaultOutputReceiver::Write(
+  const std::ostringstream& buffer) const
+{
+  std::lock_guard<std::mutex> lk(output_sync_);
+  out_ << buffer.view();
+  out_.flush();
+}
+
+inline void DefaultOutputReceiver::PrintSubtree(
+  std::ostream& out,
+  const ScopeOutput& scope,
+  int depth)
+{
+  out << std::string(2*depth, ' ')
+      << scope.name_ << " "
+      << scope.cpu_proportion_;
+
+  PrintTiming(out, scope);
+  out << '\n';
+
+  for (const auto& child : scope.scope_outputs_)
+  {
+    PrintSubtree(out, child, depth + 1);
+  }
+}
+
+inline void DefaultOutputReceiver::PrintSubtree(
+  std::ostream& out,
+  const AggregateScopeOutput& scope,
+  int depth)
+{
+  out << std::string(2*depth, ' ')
+      << scope.name_ << " "
+      << scope.cpu_proportion_
+      << " (min " << scope.min_proportion_
+      << " max " << scope.max_proportion_
+      << " stddev " << scope.stddev_proportion_ << ")";
+
+  PrintTiming(out, scope);
+  out << '\n';
+
+  for (const auto& child : scope.scope_outputs_)
+  {
+    PrintSubtree(out, child, depth + 1);
+  }
+}
+
+// This receiver writes Brendan Gregg's collapsed stack format, with one line
+// of the form "outer;inner2;inner3 <samples>" for each path, which can be
+// fed straight to flamegraph.pl or speedscope. The samples on each line are
+// the ones which were taken in that scope but not in any scope inside it.
+class CollapsedStackOutputReceiver : public OutputReceiver
+{
+public:
+  CollapsedStackOutputReceiver(std::ostream& out) : out_(out) {}
+  inline void HandleOutput(
+    const ThreadOutput& output) const;
+  inline void HandleAggregateOutput(
+    const AggregateOutput& output) const;
+
+private:
+  std::ostream& out_;
+  mutable std::mutex output_sync_;
+
+  // These are reused between outputs to avoid allocating.
+  mutable std::string path_;
+  mutable std::string buffer_;
+
+  template <typename Output>
+  inline void Write(const Output& output) const;
+
+  template <typename Scope>
+  inline void WriteSubtree(const Scope& scope) const;
+};
+
+inline void CollapsedStackOutputReceiver::HandleOutput(
+  const ThreadOutput& output) const
+{
+  Write(output);
+}
+
+inline void CollapsedStackOutputReceiver::HandleAggregateOutput(
+  const AggregateOutput& output) const
+{
+  Write(output);
+}
+
+template <typename Output>
+inline void CollapsedStackOutputReceiver::Write(const Output& output) const
+{
+  std::lock_guard<std::mutex> lk(output_sync_);
+
+  path_.clear();
+  buffer_.clear();
+  for (const auto& child : output.scope_outputs_)
+  {
+    WriteSubtree(child);
+  }
+
+  out_.write(buffer_.data(), buffer_.size());
+  out_.flush();
+}
+
+template <typename Scope>
+inline void CollapsedStackOutputReceiver::WriteSubtree(
+  const Scope& scope) const
+{
+  const std::size_t parent_length = path_.size();
+  if (parent_length > 0)
+  {
+    path_ += ';';
+  }
+
+  path_ += scope.name_;
+
+  if (scope.self_samples_ > 0)
+  {
+    char digits[24];
+    const auto result =
+      std::to_chars(digits, digits + sizeof(digits), scope.self_samples_);
+
+    buffer_ += path_;
+    buffer_ += ' ';
+    buffer_.append(digits, result.ptr);
+    buffer_ += '\n';
+  }
+
+  for (const auto& child : scope.scope_outputs_)
+  {
+    WriteSubtree(child);
+  }
+
+  path_.resize(parent_length);
+}
+
+// This receiver writes a compact binary format which is cheap to produce
+// and can be converted to text later by the lurien_convert tool. The file
+// starts with the magic "LURN" and a version, followed by records which each
+// start with a one byte tag. All integers are little-endian and doubles are
+// written as the integer with the same bits.
+//
+// 'S' record: a string table entry. Each scope name is written once.
+//   u32 name id, u32 length, name bytes
+// 'T' record: one ThreadOutput.
+//   u8 kind, u64 native thread ID, u64 sampling interval in nanoseconds,
+//   u64 total samples, u32 thread name id, u32 tag count, then for each tag
+//   u32 key name id and u32 value name id, u32 node count, then for each
+//   node:
+//   u32 parent node index (all ones for top level scopes), u32 name id,
+//   u64 self samples, u64 recursive calls
+// 'A' record: one AggregateOutput.
+//   u8 kind, u64 sampling interval in nanoseconds, u64 total samples,
+//   u64 thread count, u32 thread name id, u32 node count, then for each
+//   node:
+//   u32 parent node index, u32 name id, u64 self samples, u64 thread count,
+//   f64 min, max, mean and standard deviation of the threads' proportions
+// Nodes always come after their parents. Version 1 files have no thread
+// name or tags, and files before version 3 have no 'A' records.
+class BinaryOutputReceiver : public OutputReceiver
+{
+public:
+  static constexpr char kMagic[4] = { 'L', 'U', 'R', 'N' };
+  static constexpr std::uint32_t kVersion = 3;
+  static constexpr std::uint32_t kNoParent = ~std::uint32_t(0);
+
+  inline BinaryOutputReceiver(std::ostream& out);
+  inline void HandleOutput(
+    const ThreadOutput& output) const;
+  inline void HandleAggregateOutput(
+    const AggregateOutput& output) const;
+
+private:
+  std::ostream& out_;
+  mutable std::mutex output_sync_;
+  mutable std::unordered_map<std::string, std::uint32_t> name_ids_;
+
+  // The records for each output are built here and written in one go.
+  mutable std::string buffer_;
+  mutable std::string strings_;
+
+  // The file's id for each interned scope name, indexed by its id.
+  mutable std::vector<std::uint32_t> scope_name_ids_;
+
+  inline std::uint32_t NameId(const std::string& name) const;
+  inline std::uint32_t ScopeNameId(
+    const std::string& name,
+    std::uint32_t name_id) const;
+
+  // Append the nodes of a tree to buffer_, returning how many there were.
+  template <typename Scope, typename AppendFields>
+  inline std::uint32_t AppendScopes(
+    const std::list<Scope>& scopes,
+    AppendFields append_fields) const;
+
+  inline void Write(const std::string& header) const;
+
+  template <typename T>
+  inline static void Append(std::string& buffer, T value);
+};
+
+inline BinaryOutputReceiver::BinaryOutputReceiver(std::ostream& out)
+:
+  out_(out)
+{
+  std::string header(kMagic, sizeof(kMagic));
+  Append(header, kVersion);
+  out_.write(header.data(), header.size());
+}
+
+template <typename T>
+inline void BinaryOutputReceiver::Append(std::string& buffer, T value)
+{
+  std::uint64_t bits;
+  if constexpr (std::is_floating_point_v<T>)
+  {
+    bits = std::bit_cast<std::uint64_t>(double(value));
+  }
+  else
+  {
+    bits = std::uint64_t(value);
+  }
+
+  for (std::size_t i = 0; i < sizeof(T); i++)
+  {
+    buffer += char((bits >> (8*i)) & 0xff);
+  }
+}
+
+inline std::uint32_t BinaryOutputReceiver::NameId(
+  const std::string& name) const
+{
+  auto [it, inserted] = name_ids_.try_emplace(
+    name, std::uint32_t(name_ids_.size()));
+  if (inserted)
+  {
+    strings_ += 'S';
+    Append(strings_, it->second);
+    Append(strings_, std::uint32_t(name.size()));
+    strings_ += name;
+  }
+
+  return it->second;
+}
+
+inline std::uint32_t BinaryOutputReceiver::ScopeNameId(
+  const std::string& name,
+  std::uint32_t name_id) const
+{
+  // Interned names are found by their id rather than by hashing them.
+  if (name_id == kNoScopeName)
+  {
+    return NameId(name);
+  }
+
+  if (name_id >= scope_name_ids_.size())
+  {
+    scope_name_ids_.resize(name_id + 1, kNoScopeName);
+  }
+
+  std::uint32_t& id = scope_name_ids_[name_id];
+  if (id == kNoScopeName)
+  {
+    id = NameId(name);
+  }
+
+  return id;
+}
+
+template <typename Scope, typename AppendFields>
+inline std::uint32_t BinaryOutputReceiver::AppendScopes(
+  const std::list<Scope>& scopes,
+  AppendFields append_fields) const
+{
+  // Flatten the tree in pre-order, which puts parents before children.
+  std::uint32_t node_count = 0;
+  std::vector<std::pair<const Scope*, std::uint32_t>> pending;
+  for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+  {
+    pending.emplace_back(&*it, kNoParent);
+  }
+
+  while (!pending.empty())
+  {
+    const auto [scope, parent] = pending.back();
+    pending.pop_back();
+
+    Append(buffer_, parent);
+    Append(buffer_, ScopeNameId(scope->name_, scope->name_id_));
+    Append(buffer_, scope->self_samples_);
+    append_fields(*scope);
+
+    for (auto it = scope->scope_outputs_.rbegin();
+         it != scope->scope_outputs_.rend();
+         ++it)
+    {
+      pending.emplace_back(&*it, node_count);
+    }
+
+    ++node_count;
+  }
+
+  return node_count;
+}
+
+inline void BinaryOutputReceiver::Write(const std::string& header) const
+{
+  // Any new names have to be defined before they are used.
+  out_.write(strings_.data(), strings_.size());
+  out_.write(header.data(), header.size());
+  out_.write(buffer_.data(), buffer_.size());
+  out_.flush();
+}
+
+inline void BinaryOutputReceiver::HandleOutput(
+  const ThreadOutput& output) const
+{
+  std::lock_guard<std::mutex> lk(output_sync_);
+
+  buffer_.clear();
+  strings_.clear();
+
+  const std::uint32_t node_count = AppendScopes(
+    output.scope_outputs_,
+    [this] (const ScopeOutput& scope)
+    {
+      Append(buffer_, scope.recursive_calls_);
+    });
+
+  std::string header;
+  header += 'T';
+  Append(header, std::uint8_t(output.kind_));
+  Append(header, output.native_thread_id_);
+  Append(header, std::uint64_t(output.sampling_interval_.count()));
+  Append(header, output.total_samples_);
+  Append(header, NameId(output.thread_name_));
+  Append(header, std::uint32_t(output.tags_.size()));
+  for (const auto& [key, value] : output.tags_)
+  {
+    Append(header, NameId(key));
+    Append(header, NameId(value));
+  }
+
+  Append(header, node_count);
+  Write(header);
+}
+
+inline void BinaryOutputReceiver::HandleAggregateOutput(
+  const AggregateOutput& output) const
+{
+  std::lock_guard<std::mutex> lk(output_sync_);
+
+  buffer_.clear();
+  strings_.clear();
+
+  const std::uint32_t node_count = AppendScopes(
+    output.scope_outputs_,
+    [this] (const AggregateScopeOutput& scope)
+    {
+      Append(buffer_, std::uint64_t(scope.thread_count_));
+      Append(buffer_, scope.min_proportion_);
+      Append(buffer_, scope.max_proportion_);
+      Append(buffer_, scope.mean_proportion_);
+      Append(buffer_, scope.stddev_proportion_);
+    });
+
+  std::string header;
+  header += 'A';
+  Append(header, std::uint8_t(output.kind_));
+  Append(header, std::uint64_t(output.sampling_interval_.count()));
+  Append(header, output.total_samples_);
+  Append(header, std::uint64_t(output.thread_count_));
+  Append(header, NameId(output.thread_name_));
+  Append(header, node_count);
+  Write(header);
+}
+
+// One output read back from a file written by a BinaryOutputReceiver.
+using BinaryProfileOutput = std::variant<ThreadOutput, AggregateOutput>;
+
+// Read back everything written by a BinaryOutputReceiver, in the order it
+// was written. This throws std::runtime_error if the input is not a valid
+// profile.
+inline std::vector<BinaryProfileOutput> ReadBinaryProfile(std::istream& in)
+{
+  // The whole profile is read first so that every count in it can be
+  // checked against the bytes which are left before anything is allocated
+  // for it.
+  const std::string data(
+    (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  std::size_t offset = 0;
+
+  auto remaining = [&data, &offset] () { return data.size() - offset; };
+
+  auto check_count = [&remaining] (std::uint64_t count, std::size_t bytes)
+  {
+    if (count > remaining() / bytes)
+    {
+      throw std::runtime_error("Unexpected end of Lurien profile");
+    }
+  };
+
+  auto read_bytes = [&data, &offset, &check_count] (
+    char* bytes,
+    std::size_t size)
+  {
+    check_count(size, 1);
+    std::copy_n(data.data() + offset, size, bytes);
+    offset += size;
+  };
+
+  auto read_kind = [] (std::uint8_t kind)
+  {
+    if (kind > std::uint8_t(OutputKind::Snapshot))
+    {
+      throw std::runtime_error("Invalid output kind in Lurien profile");
+    }
+
+    return OutputKind(kind);
+  };
+
+  auto read = [&read_bytes] <typename T> (T& value)
+  {
+    unsigned char bytes[sizeof(T)];
+    read_bytes(reinterpret_cast<char*>(bytes), sizeof(T));
+
+    std::uint64_t result = 0;
+    for (std::size_t i = 0; i < sizeof(T); i++)
+    {
+      result |= std::uint64_t(bytes[i]) << (8*i);
+    }
+
+    if constexpr (std::is_floating_point_v<T>)
+    {
+      value = T(std::bit_cast<double>(result));
+    }
+    else
+    {
+      value = T(result);
+    }
+  };
+
+  char magic[sizeof(BinaryOutputReceiver::kMagic)];
+  read_bytes(magic, sizeof(magic));
+
+  std::uint32_t version;
+  read(version);
+  if (!std::equal(magic, magic + sizeof(magic), BinaryOutputReceiver::kMagic)
+   || version < 1
+   || version > BinaryOutputReceiver::kVersion)
+  {
+    throw std::runtime_error("Not a Lurien profile");
+  }
+
+  std::unordered_map<std::uint32_t, std::string> names;
+  std::vector<BinaryProfileOutput> outputs;
+
+  auto read_name = [&read, &names] () -> const std::string&
+  {
+    std::uint32_t name_id;
+    read(name_id);
+
+    auto name = names.find(name_id);
+    if (name == names.end())
+    {
+      throw std::runtime_error("Unknown name in Lurien profile");
+    }
+
+    return name->second;
+  };
+
+  // Read a tree's nodes into the list of its top level scopes, filling in
+  // what the records leave out.
+  auto read_scopes = [&read, &read_name, &check_count]
+    <typename Scope, typename ReadFields> (
+      std::list<Scope>& top_level,
+      std::uint64_t total_samples,
+      std::size_t node_bytes,
+      ReadFields read_fields)
+  {
+    std::uint32_t node_count;
+    read(node_count);
+    check_count(node_count, node_bytes);
+
+    const double total = double(std::max<std::uint64_t>(total_samples, 1));
+
+    std::vector<std::uint32_t> parents(node_count);
+    std::vector<Scope*> scopes(node_count);
+    for (std::uint32_t i = 0; i < node_count; i++)
+    {
+      read(parents[i]);
+      const std::string& name = read_name();
+
+      if (parents[i] != BinaryOutputReceiver::kNoParent && parents[i] >= i)
+      {
+        throw std::runtime_error("Invalid node in Lurien profile");
+      }
+
+      auto& siblings = parents[i] == BinaryOutputReceiver::kNoParent
+        ? top_level : scopes[parents[i]]->scope_outputs_;
+
+      Scope& scope = siblings.emplace_back();
+      scope.name_ = name;
+      scope.name_id_ = details::RegisterScopeName(name);
+      read(scope.self_samples_);
+      read_fields(scope);
+      scope.inclusive_samples_ = scope.self_samples_;
+      scope.self_proportion_ = scope.self_samples_ / total;
+      scopes[i] = &scope;
+    }
+
+    for (std::uint32_t i = node_count; i-- > 0;)
+    {
+      Scope& scope = *scopes[i];
+      scope.cpu_proportion_ = scope.inclusive_samples_ / total;
+      if (parents[i] != BinaryOutputReceiver::kNoParent)
+      {
+        scopes[parents[i]]->inclusive_samples_ += scope.inclusive_samples_;
+      }
+    }
+  };
+
+  while (remaining() > 0)
+  {
+    char tag;
+    read_bytes(&tag, 1);
+
+    if (tag == 'S')
+    {
+      std::uint32_t id, length;
+      read(id);
+      read(length);
+      check_count(length, 1);
+
+      std::string name(length, '\0');
+      read_bytes(name.data(), length);
+      names[id] = std::move(name);
+    }
+    else if (tag == 'T')
+    {
+      ThreadOutput output {};
+
+      std::uint8_t kind;
+      std::uint64_t interval;
+      read(kind);
+      read(output.native_thread_id_);
+      read(interval);
+      read(output.total_samples_);
+
+      if (version >= 2)
+      {
+        output.thread_name_ = read_name();
+
+        std::uint32_t tag_count;
+        read(tag_count);
+        check_count(tag_count, 2*sizeof(std::uint32_t));
+        for (std::uint32_t i = 0; i < tag_count; i++)
+        {
+          const std::string& key = read_name();
+          output.tags_[key] = read_name();
+        }
+      }
+
+      output.kind_ = read_kind(kind);
+      output.sampling_interval_ = std::chrono::nanoseconds(interval);
+
+      // Each node has a parent, a name, self samples and recursive calls.
+      read_scopes(
+        output.scope_outputs_,
+        output.total_samples_,
+        24,
+        [&read] (ScopeOutput& scope)
+        {
+          read(scope.recursive_calls_);
+        });
+
+      outputs.emplace_back(std::move(output));
+    }
+    else if (tag == 'A' && version >= 3)
+    {
+      AggregateOutput output {};
+
+      std::uint8_t kind;
+      std::uint64_t interval, thread_count;
+      read(kind);
+      read(interval);
+      read(output.total_samples_);
+      read(thread_count);
+      output.thread_name_ = read_name();
+
+      output.kind_ = read_kind(kind);
+      output.sampling_interval_ = std::chrono::nanoseconds(interval);
+      output.thread_count_ = std::size_t(thread_count);
+
+      // Each node also has a thread count and four proportions.
+      read_scopes(
+        output.scope_outputs_,
+        output.total_samples_,
+        56,
+        [&read] (AggregateScopeOutput& scope)
+        {
+          std::uint64_t scope_threads;
+          read(scope_threads);
+          scope.thread_count_ = std::size_t(scope_threads);
+          read(scope.min_proportion_);
+          read(scope.max_proportion_);
+          read(scope.mean_proportion_);
+          read(scope.stddev_proportion_);
+        });
+
+      outputs.emplace_back(std::move(output));
+    }
+    else
+    {
+      throw std::runtime_error("Unknown record in Lurien profile");
+    }
+  }
+
+  return outputs;
+}
+
+// This receiver writes pprof profiles: the gzip-free protobuf encoding of
+// the Profile message from github.com/google/pprof/proto/profile.proto.
+// Scopes become functions and locations, and each path with self samples
+// becomes a sample labelled with its thread's ID, name and tags. Values are
+// reported both as sample counts and as nanoseconds using the achieved
+// sampling interval, or the requested one for outputs which have none yet.
+// The nanoseconds are CPU time with the signal backend and wall clock time
+// with the sampling threads.
+//
+// Each output is written as a fragment of a Profile which only defines the
+// strings, functions and locations that earlier fragments didn't. Protobuf
+// merges concatenated messages by appending their repeated fields, so the
+// whole stream reads as a single valid Profile.
+class PprofOutputReceiver : public OutputReceiver
+{
+public:
+  PprofOutputReceiver(std::ostream& out) : out_(out) {}
+  inline void HandleOutput(
+    const ThreadOutput& output) const;
+  inline void HandleAggregateOutput(
+    const AggregateOutput& output) const;
+
+private:
+  std::ostream& out_;
+  mutable std::mutex output_sync_;
+  mutable bool started_ = false;
+  mutable std::unordered_map<std::string, std::int64_t> strings_;
+  mutable std::unordered_map<std::string, std::uint64_t> functions_;
+  mutable std::string buffer_;
+
+  template <typename Output>
+  inline void Write(
+    const Output& output,
+    std::chrono::nanoseconds interval,
+    const ThreadOutput* thread) const;
+
+  inline std::int64_t StringIndex(const std::string& value) const;
+  inline std::uint64_t FunctionId(const std::string& name) const;
+
+  inline static void AppendVarint(std::string& buffer, std::uint64_t value);
+  inline static void AppendTag(
+    std::string& buffer,
+    int field,
+    int wire_type);
+  inline static void AppendInt(
+    std::string& buffer,
+    int field,
+    std::uint64_t value);
+  inline static void AppendBytes(
+    std::string& buffer,
+    int field,
+    const std::string& value);
+  inline static std::string ValueType(std::int64_t type, std::int64_t unit);
+};
+
+inline void PprofOutputReceiver::AppendVarint(
+  std::string& buffer,
+  std::uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    buffer += char((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+
+  buffer += char(value);
+}
+
+inline void PprofOutputReceiver::AppendTag(
+  std::string& buffer,
+  int field,
+  int wire_type)
+{
+  AppendVarint(buffer, (std::uint64_t(field) << 3) | wire_type);
+}
+
+inline void PprofOutputReceiver::AppendInt(
+  std::string& buffer,
+  int field,
+  std::uint64_t value)
+{
+  AppendTag(buffer, field, 0);
+  AppendVarint(buffer, value);
+}
+
+inline void PprofOutputReceiver::AppendBytes(
+  std::string& buffer,
+  int field,
+  const std::string& value)
+{
+  AppendTag(buffer, field, 2);
+  AppendVarint(buffer, value.size());
+  buffer += value;
+}
+
+inline std::string PprofOutputReceiver::ValueType(
+  std::int64_t type,
+  std::int64_t unit)
+{
+  std::string value_type;
+  AppendInt(value_type, 1, type);
+  AppendInt(value_type, 2, unit);
+  return value_type;
+}
+
+// New strings are appended to the fragment's string table as they are
+// found, so they must be looked up in the order the table is written.
+inline std::int64_t PprofOutputReceiver::StringIndex(
+  const std::string& value) const
+{
+  auto [it, inserted] = strings_.try_emplace(
+    value, std::int64_t(strings_.size()));
+  if (inserted)
+  {
+    AppendBytes(buffer_, 6, value);
+  }
+
+  return it->second;
+}
+
+// A function's location shares its ID.
+inline std::uint64_t PprofOutputReceiver::FunctionId(
+  const std::string& name) const
+{
+  auto [it, inserted] = functions_.try_emplace(
+    name, std::uint64_t(functions_.size() + 1));
+  if (inserted)
+  {
+    const std::int64_t name_index = StringIndex(name);
+
+    std::string function;
+    AppendInt(function, 1, it->second);
+    AppendInt(function, 2, name_index);
+    AppendInt(function, 3, name_index);
+    AppendBytes(buffer_, 5, function);
+
+    std::string line;
+    AppendInt(line, 1, it->second);
+
+    std::string location;
+    AppendInt(location, 1, it->second);
+    AppendBytes(location, 4, line);
+    AppendBytes(buffer_, 4, location);
+  }
+
+  return it->second;
+}
+
+inline void PprofOutputReceiver::HandleOutput(
+  const ThreadOutput& output) const
+{
+  Write(output, output.sampling_interval_, &output);
+}
+
+inline void PprofOutputReceiver::HandleAggregateOutput(
+  const AggregateOutput& output) const
+{
+  Write(output, output.sampling_interval_, nullptr);
+}
+
+template <typename Output>
+inline void PprofOutputReceiver::Write(
+  const Output& output,
+  std::chrono::nanoseconds interval,
+  const ThreadOutput* thread) const
+{
+  std::lock_guard<std::mutex> lk(output_sync_);
+
+  buffer_.clear();
+
+  // A thread which exits before the sampler has finished a pass has no
+  // achieved interval yet.
+  if (interval.count() == 0)
+  {
+    interval = details::ActiveOptions().sampling_interval;
+  }
+
+  if (!started_)
+  {
+    // The string table must start with the empty string.
+    StringIndex("");
+
+    // The signal backend samples CPU time and the sampling threads sample
+    // wall clock time.
+    const std::int64_t samples = StringIndex("samples");
+    const std::int64_t count = StringIndex("count");
+    const std::int64_t time =
+      StringIndex(details::UsingSignalBackend() ? "cpu" : "wall");
+    const std::int64_t nanoseconds = StringIndex("nanoseconds");
+
+    AppendBytes(buffer_, 1, ValueType(samples, count));
+    AppendBytes(buffer_, 1, ValueType(time, nanoseconds));
+    AppendBytes(buffer_, 11, ValueType(time, nanoseconds));
+    AppendInt(buffer_, 12, interval.count());
+    started_ = true;
+  }
+
+  // Each label is a length delimited Label message in the sample.
+  std::string labels;
+  auto add_label = [this, &labels] (const std::string& key, auto value)
+  {
+    std::string label;
+    AppendInt(label, 1, StringIndex(key));
+    if constexpr (std::is_integral_v<decltype(value)>)
+    {
+      AppendInt(label, 3, value);
+    }
+    else
+    {
+      AppendInt(label, 2, StringIndex(value));
+    }
+
+    AppendBytes(labels, 3, label);
+  };
+
+  if (!output.thread_name_.empty())
+  {
+    add_label("thread_name", output.thread_name_);
+  }
+
+  if (thread != nullptr)
+  {
+    add_label("thread", thread->native_thread_id_);
+    for (const auto& [key, value] : thread->tags_)
+    {
+      add_label(key, value);
+    }
+  }
+
+  // Walk the tree keeping the stack of location IDs for the current path.
+  std::vector<std::uint64_t> stack;
+  auto write_subtree = [&] (auto& self, const auto& scope) -> void
+  {
+    stack.push_back(FunctionId(scope.name_));
+
+    if (scope.self_samples_ > 0)
+    {
+      // Locations are listed from the leaf to the root.
+      std::string locations;
+      for (auto it = stack.rbegin(); it != stack.rend(); ++it)
+      {
+        AppendVarint(locations, *it);
+      }
+
+      std::string values;
+      AppendVarint(values, scope.self_samples_);
+      AppendVarint(values, scope.self_samples_ * interval.count());
+
+      std::string sample;
+      AppendBytes(sample, 1, locations);
+      AppendBytes(sample, 2, values);
+      sample += labels;
+
+      AppendBytes(buffer_, 2, sample);
+    }
+
+    for (const auto& child : scope.scope_outputs_)
+    {
+      self(self, child);
+    }
+
+    stack.pop_back();
+  };
+
+  for (const auto& child : output.scope_outputs_)
+  {
+    write_subtree(write_subtree, child);
+  }
+
+  out_.write(buffer_.data(), buffer_.size());
+  out_.flush();
+}
+
+namespace details
+{
+
+class ThreadSamplingData;
+
+// A fixed size open addressing table of the scopes which have a filter.
+// Threads find a scope's filter without locking, and only look at all if
+// there are any filters.
+class ScopeFilters
+{
+public:
+  static constexpr std::size_t kCapacity = 256;
+
+  bool Active() const { return active_.load(std::memory_order_relaxed) > 0; }
+  inline FilterMode Find(std::uint32_t name_id) const;
+
+  // This throws std::runtime_error if the table is full.
+  inline void Set(std::uint32_t name_id, FilterMode mode);
+
+private:
+  // Zero marks an empty slot. Slots are never emptied once used, only
+  // given FilterMode::None, so that lookups can stop at an empty slot.
+  std::array<std::atomic<std::uint32_t>, kCapacity> ids_ {};
+  std::array<std::atomic<FilterMode>, kCapacity> modes_ {};
+  std::atomic<std::size_t> active_ = 0;
+  std::mutex sync_;
+
+  // Name ids are offset so that they are never zero.
+  static std::uint32_t Key(std::uint32_t name_id) { return name_id + 1; }
+};
+
+inline FilterMode ScopeFilters::Find(std::uint32_t name_id) const
+{
+  const std::uint32_t key = Key(name_id);
+  for (std::size_t i = 0; i < kCapacity; i++)
+  {
+    const std::size_t slot = (key + i) % kCapacity;
+    const std::uint32_t id = ids_[slot].load(std::memory_order_acquire);
+    if (id == key)
+    {
+      return modes_[slot].load(std::memory_order_relaxed);
+    }
+    else if (id == 0)
+    {
+      break;
+    }
+  }
+
+  return FilterMode::None;
+}
+
+inline void ScopeFilters::Set(std::uint32_t name_id, FilterMode mode)
+{
+  std::lock_guard<std::mutex> lk(sync_);
+
+  const std::uint32_t key = Key(name_id);
+  for (std::size_t i = 0; i < kCapacity; i++)
+  {
+    const std::size_t slot = (key + i) % kCapacity;
+    const std::uint32_t id = ids_[slot].load(std::memory_order_relaxed);
+    if (id != key && id != 0)
+    {
+      continue;
+    }
+
+    const FilterMode previous = id == 0
+      ? FilterMode::None : modes_[slot].load(std::memory_order_relaxed);
+    if (id == 0 && mode == FilterMode::None)
+    {
+      return;
+    }
+
+    // The mode has to be in place before the slot is found.
+    modes_[slot].store(mode, std::memory_order_relaxed);
+    ids_[slot].store(key, std::memory_order_release);
+
+    const std::size_t active = active_.load(std::memory_order_relaxed);
+    if (previous == FilterMode::None && mode != FilterMode::None)
+    {
+      active_.store(active + 1, std::memory_order_relaxed);
+    }
+    else if (previous != FilterMode::None && mode == FilterMode::None)
+    {
+      active_.store(active - 1, std::memory_order_relaxed);
+    }
+
+    return;
+  }
+
+  throw std::runtime_error("Too many Lurien scope filters");
+}
+
+// What a Scope did when it was constructed, so that its destructor can undo
+// it.
+enum class ScopeState : std::uint8_t
+{
+  Skipped,
+  Entered,
+  Suppressing
+};
+
+constexpr std::uint32_t kNoNode = ~std::uint32_t(0);
+
+class AtomicLatencyHistogram;
+
+// Data written by different threads is kept this far apart.
+constexpr std::size_t kCacheLineSize = 64;
+
+// The hardware counters in the order of HardwareCounters' fields.
+constexpr std::size_t kHardwareCounterCount = 4;
+
+// A node in a thread's scope tree. A node's parent always has a smaller
+// index than the node itself, so the nodes are stored in a valid
+// topological order. Its samples are counted separately, so that the
+// sampler never writes to memory which the owning thread writes.
+struct ScopeNode
+{
+  std::uint32_t name_id_ = kNoScopeName;
+  std::uint32_t parent_ = kNoNode;
+
+  // How many times the node is on the owning thread's stack, which is more
+  // than once while it is being recursed into. Nobody else reads this.
+  std::uint32_t active_ = 0;
+
+  // These are only modified by the owning thread. Times are in timestamp
+  // ticks.
+  std::atomic<std::uint64_t> recursive_calls_ = 0;
+  std::atomic<std::uint64_t> calls_ = 0;
+  std::atomic<std::uint64_t> total_ticks_ = 0;
+  std::atomic<std::uint64_t> max_ticks_ = 0;
+
+  // This is allocated by the owning thread the first time a timed scope
+  // exits if Options::latency_histograms is set.
+  std::atomic<AtomicLatencyHistogram*> latency_ = nullptr;
+
+  // Hardware counts while this was the innermost scope, which are only
+  // modified by the owning thread.
+  std::array<std::atomic<std::uint64_t>, kHardwareCounterCount> hardware_ {};
+
+  // Allocations made while this was the innermost scope, which are only
+  // modified by the owning thread.
+  std::atomic<std::uint64_t> allocations_ = 0;
+  std::atomic<std::uint64_t> allocated_bytes_ = 0;
+  std::atomic<std::uint64_t> deallocations_ = 0;
+
+  inline ~ScopeNode();
+};
+
+// A copy of a node's counters taken at one point in time.
+struct NodeCounts
+{
+  std::uint64_t samples_ = 0;
+  std::uint64_t recursive_calls_ = 0;
+  std::uint64_t calls_ = 0;
+  std::uint64_t total_ticks_ = 0;
+  std::uint64_t max_ticks_ = 0;
+  std::array<std::uint64_t, kHardwareCounterCount> hardware_ {};
+  std::uint64_t allocations_ = 0;
+  std::uint64_t allocated_bytes_ = 0;
+  std::uint64_t deallocations_ = 0;
+
+  inline static NodeCounts Read(
+    const ScopeNode& node,
+    const std::atomic<std::uint64_t>& samples);
+
+  // Replace this baseline with the current counts and return the change
+  // since it was taken. Maxima can't be differenced so are passed through.
+  inline NodeCounts Advance(const NodeCounts& current);
+};
+
+inline NodeCounts NodeCounts::Read(
+  const ScopeNode& node,
+  const std::atomic<std::uint64_t>& samples)
+{
+  NodeCounts counts {
+    samples.load(std::memory_order_relaxed),
+    node.recursive_calls_.load(std::memory_order_relaxed),
+    node.calls_.load(std::memory_order_relaxed),
+    node.total_ticks_.load(std::memory_order_relaxed),
+    node.max_ticks_.load(std::memory_order_relaxed) };
+
+  for (std::size_t i = 0; i < kHardwareCounterCount; i++)
+  {
+    counts.hardware_[i] = node.hardware_[i].load(std::memory_order_relaxed);
+  }
+
+  counts.allocations_ = node.allocations_.load(std::memory_order_relaxed);
+  counts.allocated_bytes_ =
+    node.allocated_bytes_.load(std::memory_order_relaxed);
+  counts.deallocations_ = node.deallocations_.load(std::memory_order_relaxed);
+
+  return counts;
+}
+
+inline NodeCounts NodeCounts::Advance(const NodeCounts& current)
+{
+  NodeCounts delta {
+    current.samples_ - samples_,
+    current.recursive_calls_ - recursive_calls_,
+    current.calls_ - calls_,
+    current.total_ticks_ - total_ticks_,
+    current.max_ticks_ };
+
+  for (std::size_t i = 0; i < kHardwareCounterCount; i++)
+  {
+    delta.hardware_[i] = current.hardware_[i] - hardware_[i];
+  }
+
+  delta.allocations_ = current.allocations_ - allocations_;
+  delta.allocated_bytes_ = current.allocated_bytes_ - allocated_bytes_;
+  delta.deallocations_ = current.deallocations_ - deallocations_;
+
+  *this = current;
+  return delta;
+}
+
+// The counts which were reported by the previous snapshot of a thread,
+// indexed by node, which the next snapshot reports the change from. An empty
+// baseline reports everything since the thread started.
+struct SnapshotBaseline
+{
+  std::vector<NodeCounts> counts_;
+  std::vector<std::vector<std::uint64_t>> latencies_;
+  std::uint64_t total_samples_ = 0;
+};
+
+// Counters which only have one writer don't need an atomic read-modify-write.
+inline void OwnerAdd(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+{
+  counter.store(
+    counter.load(std::memory_order_relaxed) + value,
+    std::memory_order_relaxed);
+}
+
+#if defined(__linux__)
+// A group of perf_event_open counters for the calling thread. Counters which
+// can't be opened read as zero, and if the cycle counter which leads the
+// group can't be opened then none are.
+class HardwareCounterGroup
+{
+public:
+  inline HardwareCounterGroup();
+  inline ~HardwareCounterGroup();
+  HardwareCounterGroup(const HardwareCounterGroup&) = delete;
+  HardwareCounterGroup& operator=(const HardwareCounterGroup&) = delete;
+
+  inline void Open();
+  bool Opened() const { return fds_[0] >= 0; }
+
+  // Add the counts since the previous call to the node's counters.
+  inline void Attribute(ScopeNode& node);
+
+private:
+  std::array<int, kHardwareCounterCount> fds_;
+
+  // Where each counter's value appears when the group is read, or -1.
+  std::array<int, kHardwareCounterCount> positions_;
+  int count_ = 0;
+  std::array<std::uint64_t, kHardwareCounterCount> previous_ {};
+};
+
+inline HardwareCounterGroup::HardwareCounterGroup()
+{
+  fds_.fill(-1);
+  positions_.fill(-1);
+}
+
+inline HardwareCounterGroup::~HardwareCounterGroup()
+{
+  for (int fd : fds_)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+}
+
+inline void HardwareCounterGroup::Open()
+{
+  constexpr std::array<std::uint64_t, kHardwareCounterCount> kEvents {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES };
+
+  for (std::size_t i = 0; i < kHardwareCounterCount; i++)
+  {
+    perf_event_attr attr {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = kEvents[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = i == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Count this thread on whichever CPU it runs.
+    const long fd = syscall(SYS_perf_event_open, &attr, 0, -1, fds_[0], 0);
+    if (fd < 0)
+    {
+      if (i == 0)
+      {
+        return;
+      }
+
+      continue;
+    }
+
+    fds_[i] = int(fd);
+    positions_[i] = count_++;
+  }
+
+  ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+inline void HardwareCounterGroup::Attribute(ScopeNode& node)
+{
+  // With PERF_FORMAT_GROUP the values follow the number of counters.
+  std::array<std::uint64_t, kHardwareCounterCount + 1> values;
+  const std::size_t size = sizeof(std::uint64_t) * (count_ + 1);
+  if (read(fds_[0], values.data(), size) != ssize_t(size))
+  {
+    return;
+  }
+
+  for (std::size_t i = 0; i < kHardwareCounterCount; i++)
+  {
+    if (positions_[i] >= 0)
+    {
+      const std::uint64_t value = values[positions_[i] + 1];
+      OwnerAdd(node.hardware_[i], value - previous_[i]);
+      previous_[i] = value;
+    }
+  }
+}
+#endif
+
+// The storage behind a node's LatencyHistogram. The owning thread records
+// into it while other threads may read it.
+class AtomicLatencyHistogram
+{
+public:
+  inline void Record(std::uint64_t nanoseconds);
+
+  // Read the counts, reporting only those since the baseline if one is
+  // given and then replacing the baseline with the current counts.
+  inline LatencyHistogram Read(std::vector<std::uint64_t>* baseline) const;
+
+private:
+  std::array<std::atomic<std::uint64_t>, LatencyHistogram::kBuckets> counts_;
+};
+
+inline void AtomicLatencyHistogram::Record(std::uint64_t nanoseconds)
+{
+  OwnerAdd(counts_[LatencyHistogram::BucketIndex(nanoseconds)], 1);
+}
+
+inline LatencyHistogram AtomicLatencyHistogram::Read(
+  std::vector<std::uint64_t>* baseline) const
+{
+  if (baseline)
+  {
+    baseline->resize(LatencyHistogram::kBuckets);
+  }
+
+  LatencyHistogram histogram;
+  for (std::size_t i = 0; i < LatencyHistogram::kBuckets; i++)
+  {
+    std::uint64_t count = counts_[i].load(std::memory_order_relaxed);
+    if (baseline)
+    {
+      std::swap(count, (*baseline)[i]);
+      count = (*baseline)[i] - count;
+    }
+
+    if (count > 0)
+    {
+      histogram.Record(LatencyHistogram::BucketUpperBound(i), count);
+    }
+  }
+
+  return histogram;
+}
+
+inline ScopeNode::~ScopeNode()
+{
+  delete latency_.load(std::memory_order_relaxed);
+}
+
+// Timed scopes are measured in the cheapest available ticks, which are
+// converted to nanoseconds when they are reported. The TSC is assumed to be
+// invariant, as it is on all recent x86 processors.
+inline std::uint64_t ReadTimestamp()
+{
+#if defined(LURIEN_HAS_RDTSC)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Storage for items which are allocated in chunks which double in size and
+// are never moved, so their addresses are stable and other threads can read
+// any item below Size() without locking. Only one thread adds items at a
+// time.
+template <typename T>
+class StableArena
+{
+public:
+  inline std::uint32_t Size() const;
+  inline T& operator[](std::uint32_t index);
+  inline const T& operator[](std::uint32_t index) const;
+
+  // The next item is filled in and then published, which returns its index.
+  inline T& Next();
+  inline std::uint32_t Publish();
+
+private:
+  static constexpr std::uint32_t kFirstChunkSize = 64;
+  static constexpr int kFirstChunkBits = std::bit_width(kFirstChunkSize);
+  static constexpr std::size_t kMaxChunks = 25;
+
+  std::array<std::unique_ptr<T[]>, kMaxChunks> chunks_;
+  std::atomic<std::uint32_t> size_ = 0;
+
+  inline static std::size_t ChunkIndex(std::uint32_t index);
+  inline static std::uint32_t ChunkOffset(
+    std::uint32_t index,
+    std::size_t chunk);
+};
+
+template <typename T>
+inline std::uint32_t StableArena<T>::Size() const
+{
+  return size_.load(std::memory_order_acquire);
+}
+
+template <typename T>
+inline std::size_t StableArena<T>::ChunkIndex(std::uint32_t index)
+{
+  const std::uint64_t biased = std::uint64_t(index) + kFirstChunkSize;
+  return std::bit_width(biased) - kFirstChunkBits;
+}
+
+template <typename T>
+inline std::uint32_t StableArena<T>::ChunkOffset(
+  std::uint32_t index,
+  std::size_t chunk)
+{
+  return std::uint32_t(
+    std::uint64_t(index) + kFirstChunkSize - (kFirstChunkSize << chunk));
+}
+
+template <typename T>
+inline T& StableArena<T>::operator[](std::uint32_t index)
+{
+  const std::size_t chunk = ChunkIndex(index);
+  return chunks_[chunk][ChunkOffset(index, chunk)];
+}
+
+template <typename T>
+inline const T& StableArena<T>::operator[](std::uint32_t index) const
+{
+  const std::size_t chunk = ChunkIndex(index);
+  return chunks_[chunk][ChunkOffset(index, chunk)];
+}
+
+template <typename T>
+inline T& StableArena<T>::Next()
+{
+  const std::uint32_t index = size_.load(std::memory_order_relaxed);
+  const std::size_t chunk = ChunkIndex(index);
+  if (!chunks_[chunk])
+  {
+    chunks_[chunk] = std::make_unique<T[]>(kFirstChunkSize << chunk);
+  }
+
+  return chunks_[chunk][ChunkOffset(index, chunk)];
+}
+
+template <typename T>
+inline std::uint32_t StableArena<T>::Publish()
+{
+  const std::uint32_t index = size_.load(std::memory_order_relaxed);
+  size_.store(index + 1, std::memory_order_release);
+  return index;
+}
+
+// Storage for a thread's scope nodes, which only the owning thread adds.
+class ScopeArena : public StableArena<ScopeNode>
+{
+public:
+  inline std::uint32_t Add(std::uint32_t name_id, std::uint32_t parent);
+};
+
+inline std::uint32_t ScopeArena::Add(
+  std::uint32_t name_id,
+  std::uint32_t parent)
+{
+  ScopeNode& node = Next();
+  node.name_id_ = name_id;
+  node.parent_ = parent;
+  return Publish();
+}
+
+// The process-wide table of scope names. Each LURIEN_SCOPE registers its
+// name once, the first time it runs, and from then on scopes are identified
+// by the name's id. Names are never moved or removed, so they can be read
+// without locking.
+class ScopeNames
+{
+public:
+  // This gives the same id every time it is given the same name.
+  inline std::uint32_t Register(std::string_view name);
+  const std::string& Name(std::uint32_t id) const { return names_[id]; }
+
+private:
+  std::mutex sync_;
+  StableArena<std::string> names_;
+  std::unordered_map<std::string_view, std::uint32_t> ids_;
+};
+
+inline std::uint32_t ScopeNames::Register(std::string_view name)
+{
+  std::lock_guard<std::mutex> lk(sync_);
+
+  auto it = ids_.find(name);
+  if (it != ids_.end())
+  {
+    return it->second;
+  }
+
+  std::string& stored = names_.Next();
+  stored = name;
+  const std::uint32_t id = names_.Publish();
+
+  // The stored name never moves so it can be the key.
+  ids_.emplace(stored, id);
+  return id;
+}
+
+// An open addressing hash table which finds the node which is entered when
+// a scope is entered from a parent node. This is only used by the owning
+// thread and stops allocating once every path it will see has been seen.
+class ScopeLookup
+{
+public:
+  inline std::uint32_t Find(std::uint32_t parent, std::uint32_t name_id) const;
+  inline void Insert(
+    std::uint32_t parent,
+    std::uint32_t name_id,
+    std::uint32_t node);
+
+private:
+  struct Entry
+  {
+    std::uint32_t name_id_ = kNoScopeName;
+    std::uint32_t parent_ = kNoNode;
+    std::uint32_t node_ = kNoNode;
+  };
+
+  std::vector<Entry> entries_ = std::vector<Entry>(64);
+  std::size_t size_ = 0;
+
+  inline std::size_t Slot(std::uint32_t parent, std::uint32_t name_id) const;
+  inline void Grow();
+};
+
+inline std::size_t ScopeLookup::Slot(
+  std::uint32_t parent,
+  std::uint32_t name_id) const
+{
+  const std::uint64_t mixed =
+    ((std::uint64_t(name_id) << 32) | parent) * 0x9e3779b97f4a7c15ull;
+  return std::size_t(mixed ^ (mixed >> 32)) & (entries_.size() - 1);
+}
+
+inline std::uint32_t ScopeLookup::Find(
+  std::uint32_t parent,
+  std::uint32_t name_id) const
+{
+  const std::size_t mask = entries_.size() - 1;
+  for (std::size_t slot = Slot(parent, name_id);; slot = (slot + 1) & mask)
+  {
+    const Entry& entry = entries_[slot];
+    if (entry.node_ == kNoNode ||
+        (entry.parent_ == parent && entry.name_id_ == name_id))
+    {
+      return entry.node_;
+    }
+  }
+}
+
+inline void ScopeLookup::Insert(
+  std::uint32_t parent,
+  std::uint32_t name_id,
+  std::uint32_t node)
+{
+  // Keep the load factor below a half so that probe sequences stay short.
+  if (2*(size_ + 1) > entries_.size())
+  {
+    Grow();
+  }
+
+  const std::size_t mask = entries_.size() - 1;
+  std::size_t slot = Slot(parent, name_id);
+  while (entries_[slot].node_ != kNoNode)
+  {
+    slot = (slot + 1) & mask;
+  }
+
+  entries_[slot] = Entry { name_id, parent, node };
+  ++size_;
+}
+
+inline void ScopeLookup::Grow()
+{
+  std::vector<Entry> old(2*entries_.size());
+  old.swap(entries_);
+  size_ = 0;
+
+  for (const Entry& entry : old)
+  {
+    if (entry.node_ != kNoNode)
+    {
+      Insert(entry.parent_, entry.name_id_, entry.node_);
+    }
+  }
+}
+
+inline std::shared_ptr<ThreadSamplingData> CreateSamplingData();
+
+using SamplerList = std::vector<std::shared_ptr<ThreadSamplingData>>;
+
+// The threads which one sampling thread samples, and how well it is keeping
+// up with them.
+struct SamplerShard
+{
+  // This is replaced in the same way as Ext::samplers.
+  std::atomic<std::shared_ptr<const SamplerList>> threads_ =
+    std::make_shared<const SamplerList>();
+
+  // The number of running threads in the list, only used with
+  // Ext::sampler_sync held.
+  std::size_t thread_count_ = 0;
+
+  std::atomic<std::int64_t> achieved_interval_ns_ = 0;
+  std::atomic<std::uint64_t> iterations_ = 0;
+};
+
+// One scope entry or exit in a thread's trace.
+struct TraceEvent
+{
+  // This is the scope's name for an entry and kNoScopeName for an exit.
+  std::uint32_t name_id_;
+  std::uint64_t timestamp_;
+};
+
+// A single producer, single consumer queue of trace events. The owning
+// thread pushes and whoever holds the trace writer's lock drains. Neither
+// side ever waits for the other.
+class TraceRing
+{
+public:
+  inline TraceRing(std::size_t capacity);
+
+  // Push an event if at least reserve slots are free, otherwise return
+  // false and leave the ring unchanged.
+  inline bool Push(const TraceEvent& event, std::size_t reserve);
+
+  template <typename Consumer>
+  inline void Drain(Consumer&& consumer);
+
+private:
+  std::unique_ptr<TraceEvent[]> events_;
+  const std::uint64_t mask_;
+
+  // These only ever increase, so the number of events in the ring is their
+  // difference.
+  std::atomic<std::uint64_t> head_ = 0;
+  std::atomic<std::uint64_t> tail_ = 0;
+};
+
+inline TraceRing::TraceRing(std::size_t capacity)
+:
+  events_(std::make_unique<TraceEvent[]>(capacity)),
+  mask_(capacity - 1)
+{
+}
+
+inline bool TraceRing::Push(const TraceEvent& event, std::size_t reserve)
+{
+  const std::uint64_t head = head_.load(std::memory_order_relaxed);
+  const std::uint64_t tail = tail_.load(std::memory_order_acquire);
+  if (mask_ + 1 - (head - tail) < reserve)
+  {
+    return false;
+  }
+
+  events_[head & mask_] = event;
+  head_.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename Consumer>
+inline void TraceRing::Drain(Consumer&& consumer)
+{
+  const std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+  const std::uint64_t head = head_.load(std::memory_order_acquire);
+  for (std::uint64_t i = tail; i != head; i++)
+  {
+    consumer(events_[i & mask_]);
+  }
+
+  tail_.store(head, std::memory_order_release);
+}
+
+// Writes the trace events drained from threads to Options::trace_output.
+class TraceWriter
+{
+public:
+  inline void Start(std::ostream& out);
+  bool Started() const { return out_ != nullptr; }
+
+  // Write out everything in the thread's ring, and name its track in the
+  // trace if this is the last time it will be drained.
+  inline void Drain(ThreadSamplingData& thread, bool last);
+  inline void Finish(const SamplerList& threads);
+
+private:
+  std::mutex sync_;
+  std::ostream* out_ = nullptr;
+  bool finished_ = false;
+  bool first_event_ = true;
+  std::uint64_t epoch_ = 0;
+  std::uint64_t process_id_ = 0;
+  std::string buffer_;
+
+  inline void BeginEvent();
+  inline void AppendTimestamp(std::uint64_t timestamp);
+  inline void AppendString(const std::string& value);
+};
+
+#if defined(__linux__)
+// Serves aggregated profiles of the running threads on a Unix domain socket,
+// answering one request per connection on its own thread. A request is a
+// line naming the format, "text", "collapsed" or "pprof", which covers
+// everything since each thread started. Prefixing it with "sample <seconds>"
+// waits that long and only covers the samples taken meanwhile, resuming
+// recording for the window if it is paused. Threads which exit during a
+// window are left out of it, and are reported as usual.
+class ProfileServer
+{
+public:
+  // This throws std::runtime_error if the socket can't be listened on.
+  inline void Start(const std::string& path);
+  inline void Serve();
+  inline void Stop();
+
+private:
+  int listener_ = -1;
+  std::string path_;
+
+  inline void Handle(int connection) const;
+  inline std::string Respond(const std::string& request) const;
+};
+#endif
+
+// Merges threads' output, separately for each thread name if asked to.
+class AggregatorGroups
+{
+public:
+  explicit AggregatorGroups(bool by_name) : by_name_(by_name) {}
+  inline void Add(const ThreadOutput& output);
+  inline void Report(OutputKind kind) const;
+  void Clear() { groups_.clear(); }
+
+private:
+  bool by_name_;
+  std::map<std::string, Aggregator> groups_;
+};
+
+// Each thread owns its sampling data through one of these. It is destroyed
+// on the thread as the thread exits, at which point the data is handed over
+// to be reported.
+class ThreadHandle
+{
+public:
+  inline ThreadHandle();
+  inline ~ThreadHandle();
+
+  ThreadSamplingData* operator->() const { return data_.get(); }
+
+private:
+  std::shared_ptr<ThreadSamplingData> data_;
+};
+
+// All variables which need to have external linkage are static members
+// of this struct.
+struct Ext
+{
+  // Init fills in options and then publishes it, along with receiver, by
+  // pointing active_options at it. Threads which are already running see
+  // either the defaults or everything Init set up, and nothing changes once
+  // it is published.
+  inline static const Options default_options {};
+  inline static Options options;
+  inline static std::atomic<const Options*> active_options =
+    &default_options;
+  inline static std::atomic<bool> keep_sampling = true;
+
+  // Whether scopes and samples are being recorded, and which scopes are
+  // filtered out.
+  inline static std::atomic<bool> enabled = true;
+  inline static ScopeFilters filters;
+
+  // What SetEnabled last asked for, and how many sample requests to the
+  // profile server are recording regardless. enabled is only changed while
+  // holding enabled_sync, so that it stays consistent with these.
+  inline static std::mutex enabled_sync;
+  inline static bool enabled_requested = true;
+  inline static std::size_t recording_windows = 0;
+
+  // This is only started if Options::trace_output is set.
+  inline static TraceWriter trace;
+
+  inline static ScopeNames scope_names;
+
+#if defined(__linux__)
+  // This is only started if Options::server_socket_path is set.
+  inline static ProfileServer server;
+  inline static std::unique_ptr<std::thread> server_worker;
+
+  // A sample request waits on this, with reporter_sync, so that Stop can
+  // end its window early. It has its own condition variable so that the
+  // wakeups for the reporting thread can't go to it instead.
+  inline static std::condition_variable server_wakeup;
+#endif
+
+  // With the signal backend this is the sampling interval. Otherwise each
+  // shard measures its own.
+  inline static std::atomic<std::int64_t> achieved_interval_ns = 0;
+
+  // This is calibrated when Lurien is initialised.
+  inline static std::atomic<double> nanoseconds_per_tick = 1;
+  inline static std::atomic<std::int64_t> sampler_pass_ns = 0;
+  inline static std::atomic<std::uint64_t> sampler_lock_contentions = 0;
+  inline static std::vector<std::thread> sampling_workers;
+
+  // The running threads, and those which have exited since the list was
+  // last compacted. Starting threads and compaction replace the list with a
+  // modified copy while holding sampler_sync, and readers walk whichever
+  // list they loaded without holding any lock. std::atomic<std::shared_ptr>
+  // is not lock-free in libstdc++: the load and store themselves take a
+  // spinlock inside the atomic, but only for as long as it takes to copy the
+  // pointer, so a walk over the list never holds up registration.
+  inline static std::mutex sampler_sync;
+  inline static std::atomic<std::shared_ptr<const SamplerList>> samplers =
+    std::make_shared<const SamplerList>();
+
+  // The running threads again, split into one shard for each sampling
+  // thread. Init creates the shards, which never change after that, and
+  // shares out any threads which started before it. Each thread goes into
+  // the shard with the fewest threads, so shards which have lost threads
+  // are the first to get new ones. These are only modified with
+  // sampler_sync held.
+  inline static std::vector<std::unique_ptr<SamplerShard>> sampler_shards;
+  inline thread_local static ThreadHandle thread_data;
+
+  // Serialises snapshots, which protects each thread's snapshot baseline
+  // and the threads which have exited since the last snapshot if
+  // Options::merge_exited_threads is set.
+  inline static std::mutex snapshot_sync;
+  inline static AggregatorGroups exited_threads { true };
+
+  // Exiting threads queue their data here so that the reporting thread can
+  // build and output it.
+  inline static std::unique_ptr<std::thread> reporting_worker;
+  inline static std::mutex reporter_sync;
+  inline static std::condition_variable reporter_wakeup;
+  inline static bool reporting = false;
+  inline static std::vector<std::shared_ptr<ThreadSamplingData>>
+    finished_threads;
+
+  // A plain pointer to this thread's data which is safe to read from a
+  // signal handler, unlike thread_data which is lazily initialised.
+  inline thread_local static ThreadSamplingData* signal_target = nullptr;
+
+  // Likewise this is safe to read from the allocation hooks, which may run
+  // before thread_data exists or while it is being created or destroyed.
+  inline thread_local static ThreadSamplingData* allocation_target = nullptr;
+
+  // Set while Lurien is doing its own work on the thread. See InternalWork.
+  inline thread_local static bool internal_work = false;
+
+  inline static std::unique_ptr<OutputReceiver> receiver;
+};
+
+// While one of these exists the thread's allocations are Lurien's own, such
+// as a new node or a histogram, and aren't counted against its scope.
+class InternalWork
+{
+public:
+  InternalWork() : outer_(Ext::internal_work) { Ext::internal_work = true; }
+  ~InternalWork() { Ext::internal_work = outer_; }
+
+  InternalWork(const InternalWork&) = delete;
+  InternalWork& operator=(const InternalWork&) = delete;
+
+private:
+  bool outer_;
+};
+
+inline const Options& ActiveOptions()
+{
+  return *Ext::active_options.load(std::memory_order_acquire);
+}
+
+// Recording is on while SetEnabled asks for it or a sample request to the
+// profile server is running. Ext::enabled_sync must be held.
+inline void PublishEnabled()
+{
+  Ext::enabled.store(
+    Ext::enabled_requested || Ext::recording_windows > 0,
+    std::memory_order_relaxed);
+}
+
+// Whether Init has published the options and the receiver.
+inline bool Initialised()
+{
+  return &ActiveOptions() == &Ext::options;
+}
+
+inline std::uint32_t RegisterScopeName(std::string_view name)
+{
+  InternalWork internal;
+  return Ext::scope_names.Register(name);
+}
+
+inline const std::string& ScopeName(std::uint32_t name_id)
+{
+  return Ext::scope_names.Name(name_id);
+}
+
+// Lock Ext::sampler_sync, counting the times that we have to wait for it.
+inline std::unique_lock<std::mutex> LockSamplers()
+{
+  std::unique_lock<std::mutex> lk(Ext::sampler_sync, std::try_to_lock);
+  if (!lk.owns_lock())
+  {
+    Ext::sampler_lock_contentions.fetch_add(1, std::memory_order_relaxed);
+    lk.lock();
+  }
+
+  return lk;
+}
+
+inline bool UsingSignalBackend();
+
+inline Stats GetStats()
+{
+  // The shards are only created by Init, before it publishes the options.
+  std::int64_t achieved_ns =
+    Ext::achieved_interval_ns.load(std::memory_order_relaxed);
+  std::uint64_t iterations = 0;
+  if (Initialised() && !UsingSignalBackend())
+  {
+    iterations = ~std::uint64_t(0);
+    for (const auto& shard : Ext::sampler_shards)
+    {
+      iterations = std::min(
+        iterations, shard->iterations_.load(std::memory_order_relaxed));
+      achieved_ns = std::max(
+        achieved_ns,
+        shard->achieved_interval_ns_.load(std::memory_order_relaxed));
+    }
+  }
+
+  return Stats {
+    ActiveOptions().sampling_interval,
+    std::chrono::nanoseconds(achieved_ns),
+    iterations,
+    std::chrono::nanoseconds(
+      Ext::sampler_pass_ns.load(std::memory_order_relaxed)),
+    Ext::sampler_lock_contentions.load(std::memory_order_relaxed) };
+}
+
+inline std::uint64_t NativeThreadId()
+{
+#if defined(__linux__)
+  return std::uint64_t(syscall(SYS_gettid));
+#else
+  return std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
+
+inline bool UsingSignalBackend()
+{
+#if defined(__linux__)
+  return ActiveOptions().backend == SamplingBackend::Signal;
+#else
+  return false;
+#endif
+}
+
+// The scopes which a task has entered, saved while it isn't attached to a
+// thread. See TaskContext.
+struct TaskState
+{
+  // The name of each scope.
+  std::vector<std::uint32_t> path_;
+
+  // Levels which were attributed to the top of a full stack, and levels
+  // inside scopes filtered with FilterMode::Subtree.
+  std::uint32_t overflow_ = 0;
+  std::uint32_t suppressed_ = 0;
+
+  // The thread's state when the task was attached, which is restored when
+  // it is detached.
+  std::uint32_t base_depth_ = 0;
+  std::uint32_t base_overflow_ = 0;
+  std::uint32_t base_suppressed_ = 0;
+  bool attached_ = false;
+
+  // Timestamp ticks spent detached, which timed scopes inside the task
+  // leave out.
+  std::uint64_t suspended_ticks_ = 0;
+  std::uint64_t detached_at_ = 0;
+};
+
+class ThreadSamplingData
+{
+public:
+  inline ThreadSamplingData();
+  inline void Enter(std::uint32_t name_id);
+  inline void Exit();
+
+  // These apply the scope filters around Enter and Exit.
+  inline ScopeState EnterFiltered(std::uint32_t name_id);
+  inline void ExitFiltered(ScopeState state);
+
+  // Move a task's scopes onto this thread's stack, or off it again. A task
+  // must be detached from the thread it was attached to, and its scopes
+  // must all have been entered while it was attached.
+  inline void AttachTask(TaskState& task);
+  inline void DetachTask(TaskState& task);
+
+  // A timestamp for timed scopes, which doesn't advance while the task the
+  // thread is running is detached.
+  inline std::uint64_t Timestamp() const;
+  inline void ExitTimed(std::uint64_t start);
+  inline static void RecordLatency(ScopeNode& scope, std::uint64_t ticks);
+  inline void TakeSample();
+  inline void Finish();
+
+  // These are called by the owning thread.
+  inline void SetName(std::string name);
+  inline void SetTag(std::string key, std::string value);
+
+  // Snapshots may be built while the owning thread is running. Output is
+  // measured from the baseline if one is given, and snapshots use the
+  // thread's own baseline otherwise.
+  inline ThreadOutput BuildOutput(
+    OutputKind kind,
+    SnapshotBaseline* baseline = nullptr);
+
+  // This must only be used while holding Ext::snapshot_sync.
+  SnapshotBaseline& OwnBaseline() { return snapshot_; }
+
+  bool Finished() const { return finished_.load(std::memory_order_acquire); }
+
+  // This is only set up when the thread starts.
+  inline bool HasHardwareCounters() const;
+
+  // These are called by the owning thread's allocation hooks.
+  inline void RecordAllocation(std::size_t size);
+  inline void RecordDeallocation();
+
+  // This is only called by the trace writer, with its lock held.
+  template <typename Consumer>
+  inline void DrainTrace(Consumer&& consumer);
+
+  std::uint64_t NativeId() const { return native_thread_id_; }
+  inline std::string Name();
+
+  // Which sampling thread samples this one. This is only changed with
+  // Ext::sampler_sync held.
+  SamplerShard* Shard() const
+  {
+    return shard_.load(std::memory_order_relaxed);
+  }
+
+  void SetShard(SamplerShard* shard)
+  {
+    shard_.store(shard, std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr std::uint32_t kMaxStackDepth = 256;
+
+  // These are only touched by the owning thread. The stack holds the node
+  // for each active scope with the root at the bottom. Scopes nested deeper
+  // than the stack can hold are attributed to the top of the stack and just
+  // counted in stack_overflow_ so that they can be unwound.
+  std::array<std::uint32_t, kMaxStackDepth> stack_;
+  std::uint32_t depth_ = 0;
+  std::uint32_t stack_overflow_ = 0;
+
+  // How many scopes filtered with FilterMode::Subtree are active.
+  std::uint32_t suppressed_ = 0;
+
+  // This only exists when tracing. Every traced scope entry reserves a slot
+  // for its exit, so exits are never dropped and the trace stays balanced.
+  // If an entry is dropped then so is everything until its exit, which
+  // means that the traced scopes are always the bottom of the stack.
+  std::unique_ptr<TraceRing> trace_;
+
+  // The task which is attached, if any.
+  const TaskState* task_ = nullptr;
+
+  std::uint32_t traced_depth_ = 0;
+  std::uint32_t untraced_depth_ = 0;
+  std::atomic<std::uint64_t> dropped_trace_events_ = 0;
+
+  inline void TraceEnter(std::uint32_t name_id);
+  inline void TraceExit();
+  ScopeLookup lookup_;
+
+  // This is only modified by the owning thread.
+  std::atomic<std::uint64_t> scope_transitions_ = 0;
+
+  inline void CountTransition();
+
+  // Node zero is the root which collects samples taken outside of any scope.
+  ScopeArena nodes_;
+
+  // The owning thread publishes the index of the node it is in here and the
+  // sampler (either a sampling thread or this thread's signal handler) reads
+  // it, so neither side needs to take a lock or wait for the other.
+  std::atomic<std::uint32_t> current_node_ = 0;
+
+  inline std::uint32_t AddNode(std::uint32_t name_id, std::uint32_t parent);
+
+  // The sample counts for each node, which only the sampler writes. The
+  // owning thread only allocates them, before the node they belong to is
+  // published, and the total is kept off the cache line of current_node_.
+  StableArena<std::atomic<std::uint64_t>> samples_;
+  alignas(kCacheLineSize) std::atomic<std::uint64_t> total_samples_ = 0;
+
+  const std::thread::id thread_id_;
+  const std::uint64_t native_thread_id_;
+  std::atomic<SamplerShard*> shard_ = nullptr;
+  std::atomic<bool> finished_ = false;
+
+  // Set by the owning thread and read when building output. Unless the
+  // thread has been named explicitly the operating system's name for it is
+  // read when it starts and again when it finishes, in case it was renamed.
+  std::mutex label_sync_;
+  std::string name_;
+  bool named_ = false;
+  std::map<std::string, std::string> tags_;
+
+  inline void ReadSystemName();
+
+  SnapshotBaseline snapshot_;
+
+#if defined(__linux__)
+  timer_t timer_;
+  bool has_timer_ = false;
+
+  HardwareCounterGroup counters_;
+
+  inline void StartSignalTimer();
+#endif
+};
+
+// Copy a list of threads, leaving out those which have exited.
+inline std::shared_ptr<SamplerList> CopyRunning(const SamplerList& threads)
+{
+  auto running = std::make_shared<SamplerList>();
+  running->reserve(threads.size() + 1);
+  for (const auto& thread : threads)
+  {
+    if (!thread->Finished())
+    {
+      running->push_back(thread);
+    }
+  }
+
+  return running;
+}
+
+// Add a thread to the shard with the fewest threads, once Init has created
+// the shards. Ext::sampler_sync must be held.
+inline void AddToShard(const std::shared_ptr<ThreadSamplingData>& sampler)
+{
+  // A thread which has already exited has nothing left to sample.
+  if (sampler->Finished())
+  {
+    return;
+  }
+
+  SamplerShard* emptiest = nullptr;
+  for (const auto& shard : Ext::sampler_shards)
+  {
+    if (!emptiest || shard->thread_count_ < emptiest->thread_count_)
+    {
+      emptiest = shard.get();
+    }
+  }
+
+  if (emptiest)
+  {
+    auto threads = CopyRunning(*emptiest->threads_.load());
+    threads->push_back(sampler);
+    emptiest->threads_.store(std::move(threads));
+    ++emptiest->thread_count_;
+    sampler->SetShard(emptiest);
+  }
+}
+
+inline std::shared_ptr<ThreadSamplingData> CreateSamplingData()
+{
+  auto sampler = std::make_shared<ThreadSamplingData>();
+
+  auto lk = LockSamplers();
+  auto samplers = CopyRunning(*Ext::samplers.load());
+  samplers->push_back(sampler);
+  Ext::samplers.store(std::move(samplers));
+  AddToShard(sampler);
+
+  return sampler;
+}
+
+// An exiting thread has already marked itself finished, so that readers of
+// the lists skip it, and here just stops counting towards its shard. Copying
+// the lists to drop it is left to the reporting thread, which does it once
+// for each batch of exits, or to the next thread to start, so that exiting
+// doesn't get slower as the number of threads grows. Anyone still using a
+// list keeps the data alive until they are finished with it.
+inline void RetireSamplingData(const ThreadSamplingData* sampler)
+{
+  auto lk = LockSamplers();
+  if (SamplerShard* shard = sampler->Shard())
+  {
+    --shard->thread_count_;
+  }
+}
+
+// Drop the threads which have exited from every list of threads. This
+// doesn't go through LockSamplers, whose count is for starting and exiting
+// threads.
+inline void CompactSamplers()
+{
+  std::lock_guard<std::mutex> lk(Ext::sampler_sync);
+  Ext::samplers.store(CopyRunning(*Ext::samplers.load()));
+  for (const auto& shard : Ext::sampler_shards)
+  {
+    shard->threads_.store(CopyRunning(*shard->threads_.load()));
+  }
+}
+
+inline ThreadHandle::ThreadHandle()
+{
+  InternalWork internal;
+  data_ = CreateSamplingData();
+}
+
+inline ThreadHandle::~ThreadHandle()
+{
+  InternalWork internal;
+  data_->Finish();
+  RetireSamplingData(data_.get());
+
+  {
+    std::lock_guard<std::mutex> lk(Ext::reporter_sync);
+    if (Ext::reporting)
+    {
+      Ext::finished_threads.push_back(std::move(data_));
+      Ext::reporter_wakeup.notify_one();
+      return;
+    }
+  }
+
+  // If Lurien isn't running then there's nobody to hand the output to.
+  if (Initialised())
+  {
+    Ext::receiver->HandleOutput(data_->BuildOutput(OutputKind::ThreadExit));
+  }
+}
+
+// This is constructed on the thread which it describes.
+inline ThreadSamplingData::ThreadSamplingData()
+:
+  thread_id_(std::this_thread::get_id()),
+  native_thread_id_(NativeThreadId())
+{
+  stack_[0] = AddNode(kNoScopeName, kNoNode);
+
+  ReadSystemName();
+
+#if defined(__linux__)
+  if (UsingSignalBackend())
+  {
+    StartSignalTimer();
+  }
+
+  if (ActiveOptions().hardware_counters)
+  {
+    counters_.Open();
+  }
+#endif
+
+  if (ActiveOptions().trace_output)
+  {
+    trace_ = std::make_unique<TraceRing>(
+      std::bit_ceil(std::max<std::size_t>(
+        ActiveOptions().trace_buffer_events, 2*kMaxStackDepth)));
+  }
+
+  Ext::allocation_target = this;
+}
+
+inline void ThreadSamplingData::RecordAllocation(std::size_t size)
+{
+  ScopeNode& scope = nodes_[stack_[depth_]];
+  OwnerAdd(scope.allocations_, 1);
+  OwnerAdd(scope.allocated_bytes_, size);
+}
+
+inline void ThreadSamplingData::RecordDeallocation()
+{
+  OwnerAdd(nodes_[stack_[depth_]].deallocations_, 1);
+}
+
+inline std::uint32_t ThreadSamplingData::AddNode(
+  std::uint32_t name_id,
+  std::uint32_t parent)
+{
+  // Readers find a node's samples by the node's index, so the samples are
+  // published first.
+  samples_.Next();
+  samples_.Publish();
+  return nodes_.Add(name_id, parent);
+}
+
+inline bool ThreadSamplingData::HasHardwareCounters() const
+{
+#if defined(__linux__)
+  return counters_.Opened();
+#else
+  return false;
+#endif
+}
+
+#if defined(__linux__)
+inline void ThreadSamplingData::StartSignalTimer()
+{
+  Ext::signal_target = this;
+
+  sigevent event {};
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = SIGPROF;
+  event.sigev_notify_thread_id = static_cast<pid_t>(native_thread_id_);
+
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_) != 0)
+  {
+    // Sampling is best effort: this thread just won't get any samples.
+    return;
+  }
+
+  has_timer_ = true;
+
+  // A zero interval would disarm the timer, so use the smallest one instead.
+  const auto interval = std::max(
+    ActiveOptions().sampling_interval, std::chrono::nanoseconds(1));
+
+  itimerspec spec {};
+  spec.it_interval.tv_sec = interval.count() / 1000000000;
+  spec.it_interval.tv_nsec = interval.count() % 1000000000;
+  spec.it_value = spec.it_interval;
+  timer_settime(timer_, 0, &spec, nullptr);
+}
+#endif
+
+// Stop sampling this thread. It is called on the owning thread as it exits.
+inline void ThreadSamplingData::Finish()
+{
+  Ext::allocation_target = nullptr;
+
+#if defined(__linux__)
+  // Stop this thread's signal handler from touching the object first.
+  Ext::signal_target = nullptr;
+
+  if (has_timer_)
+  {
+    timer_delete(timer_);
+  }
+
+  // Whatever was counted since the last scope transition belongs to the
+  // scope the thread is in now.
+  if (counters_.Opened())
+  {
+    counters_.Attribute(nodes_[stack_[depth_]]);
+  }
+#endif
+
+  ReadSystemName();
+  finished_.store(true, std::memory_order_release);
+}
+
+inline void ThreadSamplingData::SetName(std::string name)
+{
+  InternalWork internal;
+  std::lock_guard<std::mutex> lk(label_sync_);
+  name_ = std::move(name);
+  named_ = true;
+}
+
+inline void ThreadSamplingData::SetTag(std::string key, std::string value)
+{
+  InternalWork internal;
+  std::lock_guard<std::mutex> lk(label_sync_);
+  tags_[std::move(key)] = std::move(value);
+}
+
+inline std::string ThreadSamplingData::Name()
+{
+  std::lock_guard<std::mutex> lk(label_sync_);
+  return name_;
+}
+
+inline void ThreadSamplingData::ReadSystemName()
+{
+#if defined(__linux__)
+  // Linux limits thread names to 16 bytes including the terminator.
+  char name[16];
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+  {
+    std::lock_guard<std::mutex> lk(label_sync_);
+    if (!named_)
+    {
+      name_ = name;
+    }
+  }
+#endif
+}
+
+// Convert the arena into the tree which receivers consume.
+inline ThreadOutput ThreadSamplingData::BuildOutput(
+  OutputKind kind,
+  SnapshotBaseline* baseline)
+{
+  ThreadOutput output;
+  output.thread_id_ = thread_id_;
+  output.native_thread_id_ = native_thread_id_;
+  output.kind_ = kind;
+  // Each sampling thread measures the interval it achieves for its own
+  // threads.
+  const SamplerShard* shard = Shard();
+  output.sampling_interval_ = std::chrono::nanoseconds(
+    shard && !UsingSignalBackend()
+      ? shard->achieved_interval_ns_.load(std::memory_order_relaxed)
+      : Ext::achieved_interval_ns.load(std::memory_order_relaxed));
+  output.scope_transitions_ =
+    scope_transitions_.load(std::memory_order_relaxed);
+  output.dropped_trace_events_ =
+    dropped_trace_events_.load(std::memory_order_relaxed);
+
+  // An exited thread's last events are drained here as the sampling thread
+  // no longer sees it.
+  if (kind == OutputKind::ThreadExit && trace_)
+  {
+    Ext::trace.Drain(*this, true);
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(label_sync_);
+    output.thread_name_ = name_;
+    output.tags_ = tags_;
+  }
+
+  if (ActiveOptions().report_stats)
+  {
+    output.stats_ = GetStats();
+  }
+
+  // Nodes below this size are fully initialised even if the owning thread
+  // is still adding more.
+  const std::uint32_t size = nodes_.Size();
+
+  std::vector<NodeCounts> counts(size);
+  for (std::uint32_t i = 0; i < size; i++)
+  {
+    counts[i] = NodeCounts::Read(nodes_[i], samples_[i]);
+  }
+
+  std::uint64_t total = total_samples_.load(std::memory_order_relaxed);
+
+  // Snapshots report the difference from the previous snapshot.
+  if (kind == OutputKind::Snapshot && !baseline)
+  {
+    baseline = &snapshot_;
+  }
+
+  if (baseline)
+  {
+    baseline->counts_.resize(size);
+    baseline->latencies_.resize(size);
+    for (std::uint32_t i = 0; i < size; i++)
+    {
+      counts[i] = baseline->counts_[i].Advance(counts[i]);
+    }
+
+    std::swap(total, baseline->total_samples_);
+    total = baseline->total_samples_ - total;
+  }
+
+  output.total_samples_ = total;
+  // A snapshot taken straight after another may have no samples, and then
+  // every scope's proportion is zero rather than undefined.
+  const double total_samples = double(std::max<std::uint64_t>(total, 1));
+  const double nanoseconds_per_tick =
+    Ext::nanoseconds_per_tick.load(std::memory_order_relaxed);
+
+  auto to_nanoseconds = [nanoseconds_per_tick] (std::uint64_t ticks)
+  {
+    return std::chrono::nanoseconds(
+      std::int64_t(double(ticks) * nanoseconds_per_tick));
+  };
+
+  // Accumulate the samples so that an outer scope's inclusive usage is at
+  // least the sum of its inner scopes' usages. Children always come after
+  // their parents so visiting the nodes in reverse is a post-order pass.
+  std::vector<std::uint64_t> inclusive_samples(size);
+  for (std::uint32_t i = 0; i < size; i++)
+  {
+    inclusive_samples[i] = counts[i].samples_;
+  }
+
+  for (std::uint32_t i = size - 1; i > 0; i--)
+  {
+    inclusive_samples[nodes_[i].parent_] += inclusive_samples[i];
+  }
+
+  // Hardware counters are accumulated in the same way.
+  const bool has_counters = HasHardwareCounters();
+  std::vector<HardwareCounters> inclusive_counters;
+  if (has_counters)
+  {
+    inclusive_counters.resize(size);
+    for (std::uint32_t i = 0; i < size; i++)
+    {
+      const auto& hardware = counts[i].hardware_;
+      inclusive_counters[i] = HardwareCounters {
+        hardware[0], hardware[1], hardware[2], hardware[3] };
+    }
+
+    for (std::uint32_t i = size - 1; i > 0; i--)
+    {
+      inclusive_counters[nodes_[i].parent_] += inclusive_counters[i];
+    }
+  }
+
+  std::vector<OutputNode*> outputs(size);
+  outputs[0] = &output;
+  for (std::uint32_t i = 1; i < size; i++)
+  {
+    const NodeCounts& node = counts[i];
+
+    ScopeOutput& scope =
+      outputs[nodes_[i].parent_]->scope_outputs_.emplace_back();
+    scope.name_ = ScopeName(nodes_[i].name_id_);
+    scope.name_id_ = nodes_[i].name_id_;
+    scope.self_samples_ = node.samples_;
+    scope.inclusive_samples_ = inclusive_samples[i];
+    scope.self_proportion_ = node.samples_ / total_samples;
+    scope.cpu_proportion_ = inclusive_samples[i] / total_samples;
+    scope.recursive_calls_ = node.recursive_calls_;
+    scope.calls_ = node.calls_;
+    scope.total_time_ = to_nanoseconds(node.total_ticks_);
+    scope.max_time_ = to_nanoseconds(node.max_ticks_);
+    scope.allocations_ = node.allocations_;
+    scope.allocated_bytes_ = node.allocated_bytes_;
+    scope.deallocations_ = node.deallocations_;
+
+    if (has_counters)
+    {
+      scope.self_counters_ = HardwareCounters {
+        node.hardware_[0],
+        node.hardware_[1],
+        node.hardware_[2],
+        node.hardware_[3] };
+      scope.inclusive_counters_ = inclusive_counters[i];
+    }
+
+    const AtomicLatencyHistogram* latency =
+      nodes_[i].latency_.load(std::memory_order_acquire);
+    if (latency)
+    {
+      scope.latency_ = latency->Read(
+        baseline ? &baseline->latencies_[i] : nullptr);
+    }
+
+    outputs[i] = &scope;
+  }
+
+  return output;
+}
+
+inline void ThreadSamplingData::CountTransition()
+{
+  OwnerAdd(scope_transitions_, 1);
+
+#if defined(__linux__)
+  // The counts since the last transition belong to the innermost scope,
+  // which is about to change.
+  if (counters_.Opened())
+  {
+    counters_.Attribute(nodes_[stack_[depth_]]);
+  }
+#endif
+}
+
+inline void ThreadSamplingData::Enter(std::uint32_t name_id)
+{
+  CountTransition();
+
+  if (depth_ + 1 == kMaxStackDepth)
+  {
+    ++stack_overflow_;
+    return;
+  }
+
+  const std::uint32_t parent = stack_[depth_];
+  std::uint32_t node = lookup_.Find(parent, name_id);
+
+  if (node == kNoNode)
+  {
+    InternalWork internal;
+
+    // Work out where this path should be attributed the first time it's
+    // seen and remember the answer.
+    if (ActiveOptions().recursion == RecursionMode::Collapse)
+    {
+      for (std::uint32_t ancestor = parent;
+           ancestor != 0;
+           ancestor = nodes_[ancestor].parent_)
+      {
+        if (nodes_[ancestor].name_id_ == name_id)
+        {
+          node = ancestor;
+          break;
+        }
+      }
+    }
+    else if (depth_ >= ActiveOptions().max_scope_depth)
+    {
+      node = parent;
+    }
+
+    if (node == kNoNode)
+    {
+      node = AddNode(name_id, parent);
+    }
+
+    lookup_.Insert(parent, name_id, node);
+  }
+
+  // Recursion folds a call into a node which is already active, which
+  // with mutual recursion can be a node whose parent is the current one.
+  ScopeNode& scope = nodes_[node];
+  if (scope.active_++ > 0)
+  {
+    OwnerAdd(scope.recursive_calls_, 1);
+  }
+
+  stack_[++depth_] = node;
+
+  if (trace_)
+  {
+    TraceEnter(name_id);
+  }
+
+  // The release store makes a new node's samples visible to the sampler
+  // before it can try to count samples against them.
+  current_node_.store(node, std::memory_order_release);
+}
+
+inline void ThreadSamplingData::Exit()
+{
+  CountTransition();
+
+  if (stack_overflow_ > 0)
+  {
+    --stack_overflow_;
+    return;
+  }
+
+  if (depth_ > 0)
+  {
+    if (trace_)
+    {
+      TraceExit();
+    }
+
+    --nodes_[stack_[depth_]].active_;
+    --depth_;
+  }
+
+  current_node_.store(stack_[depth_], std::memory_order_release);
+}
+
+inline void ThreadSamplingData::TraceEnter(std::uint32_t name_id)
+{
+  // Leave room for this entry and the exits of every traced scope.
+  if (untraced_depth_ == 0
+   && trace_->Push(
+        TraceEvent { name_id, ReadTimestamp() }, traced_depth_ + 2))
+  {
+    ++traced_depth_;
+    return;
+  }
+
+  ++untraced_depth_;
+  OwnerAdd(dropped_trace_events_, 2);
+}
+
+inline void ThreadSamplingData::TraceExit()
+{
+  if (untraced_depth_ > 0)
+  {
+    --untraced_depth_;
+    return;
+  }
+
+  trace_->Push(TraceEvent { kNoScopeName, ReadTimestamp() }, 1);
+  --traced_depth_;
+}
+
+template <typename Consumer>
+inline void ThreadSamplingData::DrainTrace(Consumer&& consumer)
+{
+  if (trace_)
+  {
+    trace_->Drain(consumer);
+  }
+}
+
+inline ScopeState ThreadSamplingData::EnterFiltered(std::uint32_t name_id)
+{
+  if (suppressed_ > 0)
+  {
+    return ScopeState::Skipped;
+  }
+
+  if (Ext::filters.Active()) [[unlikely]]
+  {
+    switch (Ext::filters.Find(name_id))
+    {
+    case FilterMode::Scope:
+      return ScopeState::Skipped;
+    case FilterMode::Subtree:
+      ++suppressed_;
+      return ScopeState::Suppressing;
+    case FilterMode::None:
+      break;
+    }
+  }
+
+  Enter(name_id);
+  return ScopeState::Entered;
+}
+
+inline void ThreadSamplingData::ExitFiltered(ScopeState state)
+{
+  if (state == ScopeState::Entered)
+  {
+    Exit();
+  }
+  else if (state == ScopeState::Suppressing)
+  {
+    --suppressed_;
+  }
+}
+
+inline void ThreadSamplingData::AttachTask(TaskState& task)
+{
+  if (task.attached_)
+  {
+    return;
+  }
+
+  if (task.detached_at_ != 0)
+  {
+    task.suspended_ticks_ += ReadTimestamp() - task.detached_at_;
+  }
+
+  task.base_depth_ = depth_;
+  task.base_overflow_ = stack_overflow_;
+  task.base_suppressed_ = suppressed_;
+  task.attached_ = true;
+  task_ = &task;
+
+  for (const std::uint32_t name_id : task.path_)
+  {
+    Enter(name_id);
+  }
+
+  stack_overflow_ += task.overflow_;
+  suppressed_ += task.suppressed_;
+  task.path_.clear();
+}
+
+inline void ThreadSamplingData::DetachTask(TaskState& task)
+{
+  if (!task.attached_)
+  {
+    return;
+  }
+
+  // Scopes which didn't get a level of their own can't be saved by name, so
+  // they are just counted and restored as overflow.
+  task.overflow_ = stack_overflow_ - task.base_overflow_;
+  task.suppressed_ = suppressed_ - task.base_suppressed_;
+  stack_overflow_ = task.base_overflow_;
+  suppressed_ = task.base_suppressed_;
+
+  // This saves the node which each level used, which is the scope itself
+  // unless a RecursionMode::Expand tree was at its maximum depth.
+  {
+    InternalWork internal;
+    task.path_.clear();
+    for (std::uint32_t level = task.base_depth_ + 1; level <= depth_; level++)
+    {
+      task.path_.push_back(nodes_[stack_[level]].name_id_);
+    }
+  }
+
+  while (depth_ > task.base_depth_)
+  {
+    Exit();
+  }
+
+  task.attached_ = false;
+  task.detached_at_ = ReadTimestamp();
+  task_ = nullptr;
+}
+
+inline std::uint64_t ThreadSamplingData::Timestamp() const
+{
+  const std::uint64_t now = ReadTimestamp();
+  return task_ ? now - task_->suspended_ticks_ : now;
+}
+
+inline void ThreadSamplingData::ExitTimed(std::uint64_t start)
+{
+  // If the scope wasn't pushed because the stack was full then there's
+  // nowhere to record its time.
+  if (stack_overflow_ == 0 && depth_ > 0)
+  {
+    ScopeNode& scope = nodes_[stack_[depth_]];
+    OwnerAdd(scope.calls_, 1);
+
+    // A recursive call's time is already covered by the outermost call,
+    // which is the one that leaves the node inactive.
+    if (scope.active_ == 1)
+    {
+      const std::uint64_t ticks = Timestamp() - start;
+      OwnerAdd(scope.total_ticks_, ticks);
+      if (ticks > scope.max_ticks_.load(std::memory_order_relaxed))
+      {
+        scope.max_ticks_.store(ticks, std::memory_order_relaxed);
+      }
+
+      if (ActiveOptions().latency_histograms)
+      {
+        RecordLatency(scope, ticks);
+      }
+    }
+  }
+
+  Exit();
+}
+
+inline void ThreadSamplingData::RecordLatency(
+  ScopeNode& scope,
+  std::uint64_t ticks)
+{
+  AtomicLatencyHistogram* latency =
+    scope.latency_.load(std::memory_order_relaxed);
+  if (!latency)
+  {
+    InternalWork internal;
+    latency = new AtomicLatencyHistogram();
+    scope.latency_.store(latency, std::memory_order_release);
+  }
+
+  const double nanoseconds_per_tick =
+    Ext::nanoseconds_per_tick.load(std::memory_order_relaxed);
+  latency->Record(std::uint64_t(double(ticks) * nanoseconds_per_tick));
+}
+
+inline void ThreadSamplingData::TakeSample()
+{
+  // Each thread has a single sampler, so the counts don't need an atomic
+  // read-modify-write.
+  const std::uint32_t node = current_node_.load(std::memory_order_acquire);
+  OwnerAdd(samples_[node], 1);
+  OwnerAdd(total_samples_, 1);
+}
+
+// Pin a sampling thread to its CPU and raise its priority, if asked to.
+inline void ConfigureSamplingThread(std::size_t shard)
+{
+#if defined(__linux__)
+  const auto& cpus = ActiveOptions().sampling_cpus;
+  if (!cpus.empty())
+  {
+    const int cpu = cpus[shard % cpus.size()];
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+  }
+
+  if (ActiveOptions().sampling_priority > 0)
+  {
+    sched_param param {};
+    param.sched_priority = ActiveOptions().sampling_priority;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  }
+#else
+  (void)shard;
+#endif
+}
+
+// Sample the threads in one shard of the running threads, and drain their
+// traces.
+inline void TakeSamples(std::size_t index)
+{
+  using clock = std::chrono::steady_clock;
+
+  ConfigureSamplingThread(index);
+  SamplerShard& shard = *Ext::sampler_shards[index];
+
+  const auto start = clock::now();
+  auto deadline = start;
+  auto first_pass = start;
+  std::uint64_t iterations = 0;
+
+  // With the signal backend this thread only runs to drain the trace.
+  const bool sampling = !UsingSignalBackend();
+  const auto interval = sampling
+    ? ActiveOptions().sampling_interval
+    : std::max<std::chrono::nanoseconds>(
+        ActiveOptions().sampling_interval, std::chrono::milliseconds(1));
+
+  while (Ext::keep_sampling)
+  {
+    const auto samplers = shard.threads_.load();
+
+    // While recording is paused the interval keeps ticking but no samples
+    // are taken.
+    if (sampling && Ext::enabled.load(std::memory_order_relaxed))
+    {
+      const auto pass_start = clock::now();
+
+      for (const auto& sampler : *samplers)
+      {
+        // An exited thread stays in the list until it is compacted.
+        if (!sampler->Finished())
+        {
+          sampler->TakeSample();
+        }
+      }
+
+      Ext::sampler_pass_ns.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          clock::now() - pass_start).count(),
+        std::memory_order_relaxed);
+    }
+
+    if (Ext::trace.Started())
+    {
+      for (const auto& sampler : *samplers)
+      {
+        Ext::trace.Drain(*sampler, false);
+      }
+    }
+
+    if (!sampling)
+    {
+      std::this_thread::sleep_for(interval);
+      continue;
+    }
+
+    ++iterations;
+    const auto now = clock::now();
+    shard.iterations_.store(iterations, std::memory_order_relaxed);
+
+    // The interval is measured between the ends of passes, so there is none
+    // to report until the second pass.
+    if (iterations == 1)
+    {
+      first_pass = now;
+    }
+    else
+    {
+      shard.achieved_interval_ns_.store(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          (now - first_pass) / (iterations - 1)).count(),
+        std::memory_order_relaxed);
+    }
+
+    // Sleeping until a deadline rather than for a fixed duration stops the
+    // time taken to sample from stretching the interval. If we have fallen
+    // behind then the missed samples are dropped rather than taken in a
+    // burst.
+    deadline += interval;
+    if (deadline < now)
+    {
+      deadline = now;
+    }
+    else
+    {
+      std::this_thread::sleep_until(deadline);
+    }
+  }
+}
+
+#if defined(__linux__)
+// This only touches lock-free atomics so is async-signal-safe.
+inline void HandleSamplingSignal(int)
+{
+  const int saved_errno = errno;
+
+  ThreadSamplingData* data = Ext::signal_target;
+  if (data != nullptr
+   && Ext::keep_sampling.load(std::memory_order_relaxed)
+   && Ext::enabled.load(std::memory_order_relaxed))
+  {
+    data->TakeSample();
+  }
+
+  errno = saved_errno;
+}
+
+inline void InstallSamplingSignalHandler()
+{
+  struct sigaction action {};
+  action.sa_handler = &HandleSamplingSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, nullptr);
+
+  // Every sample represents one interval of CPU time. This runs in Init
+  // before the options are published.
+  Ext::achieved_interval_ns.store(
+    Ext::options.sampling_interval.count(), std::memory_order_relaxed);
+}
+#endif
+
+inline void TraceWriter::Start(std::ostream& out)
+{
+  std::lock_guard<std::mutex> lk(sync_);
+  out_ = &out;
+  epoch_ = ReadTimestamp();
+#if defined(__linux__)
+  process_id_ = std::uint64_t(getpid());
+#endif
+
+  out << "[\n";
+}
+
+inline void TraceWriter::BeginEvent()
+{
+  if (!first_event_)
+  {
+    buffer_ += ",\n";
+  }
+
+  first_event_ = false;
+}
+
+// Chrome traces are in microseconds.
+inline void TraceWriter::AppendTimestamp(std::uint64_t timestamp)
+{
+  const double nanoseconds_per_tick =
+    Ext::nanoseconds_per_tick.load(std::memory_order_relaxed);
+  const std::uint64_t nanoseconds = timestamp > epoch_
+    ? std::uint64_t(double(timestamp - epoch_) * nanoseconds_per_tick) : 0;
+
+  const std::uint64_t fraction = nanoseconds % 1000;
+  buffer_ += std::to_string(nanoseconds / 1000);
+  buffer_ += '.';
+  buffer_ += char('0' + fraction / 100);
+  buffer_ += char('0' + fraction / 10 % 10);
+  buffer_ += char('0' + fraction % 10);
+}
+
+inline void TraceWriter::AppendString(const std::string& value)
+{
+  buffer_ += '"';
+  for (const char c : value)
+  {
+    if (c == '"' || c == '\\')
+    {
+      buffer_ += '\\';
+      buffer_ += c;
+    }
+    else if (static_cast<unsigned char>(c) < 0x20)
+    {
+      buffer_ += ' ';
+    }
+    else
+    {
+      buffer_ += c;
+    }
+  }
+
+  buffer_ += '"';
+}
+
+inline void TraceWriter::Drain(ThreadSamplingData& thread, bool last)
+{
+  std::lock_guard<std::mutex> lk(sync_);
+  if (!out_ || finished_)
+  {
+    return;
+  }
+
+  buffer_.clear();
+
+  const std::string ids = ",\"pid\":" + std::to_string(process_id_)
+    + ",\"tid\":" + std::to_string(thread.NativeId()) + "}";
+
+  thread.DrainTrace([this, &ids] (const TraceEvent& event)
+  {
+    BeginEvent();
+    if (event.name_id_ != kNoScopeName)
+    {
+      buffer_ += "{\"name\":";
+      AppendString(ScopeName(event.name_id_));
+      buffer_ += ",\"ph\":\"B\",\"ts\":";
+    }
+    else
+    {
+      buffer_ += "{\"ph\":\"E\",\"ts\":";
+    }
+
+    AppendTimestamp(event.timestamp_);
+    buffer_ += ids;
+  });
+
+  if (last)
+  {
+    BeginEvent();
+    buffer_ += "{\"name\":\"thread_name\",\"ph\":\"M\",\"args\":{\"name\":";
+    AppendString(thread.Name());
+    buffer_ += "}";
+    buffer_ += ids;
+  }
+
+  out_->write(buffer_.data(), buffer_.size());
+}
+
+inline void TraceWriter::Finish(const SamplerList& threads)
+{
+  for (const auto& thread : threads)
+  {
+    Drain(*thread, true);
+  }
+
+  std::lock_guard<std::mutex> lk(sync_);
+  if (out_ && !finished_)
+  {
+    *out_ << "\n]\n";
+    out_->flush();
+    finished_ = true;
+  }
+}
+
+inline void AggregatorGroups::Add(const ThreadOutput& output)
+{
+  static const std::string kAllThreads;
+  groups_[by_name_ ? output.thread_name_ : kAllThreads].Add(output);
+}
+
+inline void AggregatorGroups::Report(OutputKind kind) const
+{
+  for (const auto& [name, aggregator] : groups_)
+  {
+    AggregateOutput output = aggregator.Result(kind);
+    output.thread_name_ = name;
+    Ext::receiver->HandleAggregateOutput(output);
+  }
+}
+
+// Report the samples taken from every running thread since the previous
+// snapshot. The threads being snapshotted are not paused or blocked.
+inline void Snapshot()
+{
+  InternalWork internal;
+  if (!Initialised())
+  {
+    return;
+  }
+
+  const auto threads = Ext::samplers.load();
+
+  std::lock_guard<std::mutex> lk(Ext::snapshot_sync);
+
+  AggregatorGroups aggregators(ActiveOptions().group_by_thread_name);
+  for (const auto& thread : *threads)
+  {
+    if (thread->Finished())
+    {
+      continue;
+    }
+
+    ThreadOutput output = thread->BuildOutput(OutputKind::Snapshot);
+    if (ActiveOptions().aggregate_threads)
+    {
+      aggregators.Add(output);
+    }
+    else
+    {
+      Ext::receiver->HandleOutput(output);
+    }
+  }
+
+  aggregators.Report(OutputKind::Snapshot);
+
+  if (ActiveOptions().merge_exited_threads)
+  {
+    Ext::exited_threads.Report(OutputKind::ThreadExit);
+    Ext::exited_threads.Clear();
+  }
+}
+
+// Report the output of threads as they exit, and take periodic snapshots if
+// they have been asked for. This keeps formatting and I/O off the exiting
+// threads.
+inline void ReportOutputs()
+{
+  using clock = std::chrono::steady_clock;
+
+  const auto snapshot_interval = ActiveOptions().snapshot_interval;
+  const bool take_snapshots = snapshot_interval.count() > 0;
+  auto deadline = clock::now() + snapshot_interval;
+
+  std::vector<std::shared_ptr<ThreadSamplingData>> finished;
+  AggregatorGroups aggregators(ActiveOptions().group_by_thread_name);
+
+  std::unique_lock<std::mutex> lk(Ext::reporter_sync);
+  for (;;)
+  {
+    auto ready = [] {
+      return !Ext::reporting || !Ext::finished_threads.empty();
+    };
+    if (take_snapshots)
+    {
+      Ext::reporter_wakeup.wait_until(lk, deadline, ready);
+    }
+    else
+    {
+      Ext::reporter_wakeup.wait(lk, ready);
+    }
+
+    // Once reporting has stopped nothing else can be queued, so this is the
+    // last batch.
+    const bool stopping = !Ext::reporting;
+    finished.swap(Ext::finished_threads);
+    lk.unlock();
+
+    if (!finished.empty())
+    {
+      CompactSamplers();
+    }
+
+    for (auto& thread : finished)
+    {
+      // A merged thread is measured from its last snapshot, as earlier
+      // snapshots have already reported the rest.
+      if (ActiveOptions().merge_exited_threads)
+      {
+        std::lock_guard<std::mutex> snapshot_lk(Ext::snapshot_sync);
+        Ext::exited_threads.Add(thread->BuildOutput(
+          OutputKind::ThreadExit, &thread->OwnBaseline()));
+        continue;
+      }
+
+      ThreadOutput output = thread->BuildOutput(OutputKind::ThreadExit);
+      if (ActiveOptions().aggregate_threads)
+      {
+        aggregators.Add(output);
+      }
+      else
+      {
+        Ext::receiver->HandleOutput(output);
+      }
+    }
+
+    finished.clear();
+
+    if (stopping)
+    {
+      aggregators.Report(OutputKind::ThreadExit);
+
+      std::lock_guard<std::mutex> snapshot_lk(Ext::snapshot_sync);
+      Ext::exited_threads.Report(OutputKind::ThreadExit);
+      Ext::exited_threads.Clear();
+      return;
+    }
+
+    const auto now = clock::now();
+    if (take_snapshots && now >= deadline)
+    {
+      Snapshot();
+      deadline = std::max(deadline + snapshot_interval, now);
+    }
+
+    lk.lock();
+  }
+}
+
+#if defined(__linux__)
+inline void ProfileServer::Start(const std::string& path)
+{
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+  {
+    throw std::runtime_error("Lurien server socket path is too long");
+  }
+
+  std::copy(path.begin(), path.end(), address.sun_path);
+
+  // A socket left behind by an earlier process would stop us binding, so
+  // it is removed once connecting to it shows that nobody is serving it.
+  // Anything else at the path is left alone and binding then fails.
+  struct stat existing;
+  if (lstat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode))
+  {
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0)
+    {
+      const bool stale = connect(
+        probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        && errno == ECONNREFUSED;
+      close(probe);
+
+      if (stale)
+      {
+        unlink(path.c_str());
+      }
+    }
+  }
+
+  listener_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener_ < 0
+   || bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+   || listen(listener_, 8))
+  {
+    if (listener_ >= 0)
+    {
+      close(listener_);
+      listener_ = -1;
+    }
+
+    throw std::runtime_error("Lurien couldn't listen on " + path);
+  }
+
+  path_ = path;
+}
+
+inline void ProfileServer::Serve()
+{
+  // Polling lets the server notice that Lurien has stopped.
+  while (Ext::keep_sampling)
+  {
+    pollfd listener { listener_, POLLIN, 0 };
+    if (poll(&listener, 1, 100) <= 0)
+    {
+      continue;
+    }
+
+    const int connection = accept4(listener_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection >= 0)
+    {
+      Handle(connection);
+      close(connection);
+    }
+  }
+}
+
+inline void ProfileServer::Stop()
+{
+  if (listener_ >= 0)
+  {
+    close(listener_);
+    unlink(path_.c_str());
+    listener_ = -1;
+  }
+}
+
+inline void ProfileServer::Handle(int connection) const
+{
+  // A client which never finishes its request can't hold up the server.
+  timeval timeout { 1, 0 };
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  constexpr std::size_t kMaxRequest = 256;
+  std::string request;
+  char buffer[kMaxRequest];
+  while (request.find('\n') == std::string::npos
+      && request.size() < kMaxRequest)
+  {
+    const ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+    if (received <= 0)
+    {
+      break;
+    }
+
+    request.append(buffer, std::size_t(received));
+  }
+
+  request.resize(std::min(request.find_first_of("\r\n"), request.size()));
+
+  const std::string response = Respond(request);
+  std::size_t sent = 0;
+  while (sent < response.size())
+  {
+    const ssize_t written = send(
+      connection,
+      response.data() + sent,
+      response.size() - sent,
+      MSG_NOSIGNAL);
+    if (written <= 0)
+    {
+      return;
+    }
+
+    sent += std::size_t(written);
+  }
+}
+
+inline std::string ProfileServer::Respond(const std::string& request) const
+{
+  std::istringstream words(request);
+  std::string format;
+  double seconds = 0;
+  words >> format;
+  if (format == "sample" && !(words >> seconds >> format))
+  {
+    return "Expected sample <seconds> <format>\n";
+  }
+
+  std::ostringstream out;
+  std::unique_ptr<OutputReceiver> receiver;
+  if (format == "text")
+  {
+    receiver = std::make_unique<DefaultOutputReceiver>(out);
+  }
+  else if (format == "collapsed")
+  {
+    receiver = std::make_unique<CollapsedStackOutputReceiver>(out);
+  }
+  else if (format == "pprof")
+  {
+    receiver = std::make_unique<PprofOutputReceiver>(out);
+  }
+  else
+  {
+    return "Expected text, collapsed or pprof\n";
+  }
+
+  // The window is measured from baselines of our own so that it doesn't
+  // disturb periodic snapshots.
+  const auto before = Ext::samplers.load();
+  std::vector<SnapshotBaseline> baselines(before->size());
+  if (seconds > 0)
+  {
+    for (std::size_t i = 0; i < before->size(); i++)
+    {
+      if (!(*before)[i]->Finished())
+      {
+        (*before)[i]->BuildOutput(OutputKind::Snapshot, &baselines[i]);
+      }
+    }
+
+    // Recording is paused again afterwards unless the user resumes it
+    // during the window.
+    {
+      std::lock_guard<std::mutex> lk(Ext::enabled_sync);
+      ++Ext::recording_windows;
+      PublishEnabled();
+    }
+
+    {
+      std::unique_lock<std::mutex> lk(Ext::reporter_sync);
+      Ext::server_wakeup.wait_for(
+        lk,
+        std::chrono::duration<double>(seconds),
+        [] { return !Ext::reporting; });
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(Ext::enabled_sync);
+      --Ext::recording_windows;
+      PublishEnabled();
+    }
+  }
+
+  Aggregator aggregator;
+  for (const auto& thread : *Ext::samplers.load())
+  {
+    if (thread->Finished())
+    {
+      continue;
+    }
+
+    // Threads which started during the window are reported in full.
+    SnapshotBaseline started;
+    const auto found = std::find(before->begin(), before->end(), thread);
+    SnapshotBaseline& baseline = found == before->end()
+      ? started : baselines[std::size_t(found - before->begin())];
+    aggregator.Add(thread->BuildOutput(OutputKind::Snapshot, &baseline));
+  }
+
+  receiver->HandleAggregateOutput(aggregator.Result(OutputKind::Snapshot));
+  return out.str();
+}
+#endif
+
+// Work out how long a timestamp tick is.
+inline void CalibrateTimestamps()
+{
+#if defined(LURIEN_HAS_RDTSC)
+  using clock = std::chrono::steady_clock;
+
+  const auto wall_start = clock::now();
+  const std::uint64_t ticks_start = ReadTimestamp();
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  const std::uint64_t ticks = ReadTimestamp() - ticks_start;
+  const auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    clock::now() - wall_start);
+
+  if (ticks > 0)
+  {
+    Ext::nanoseconds_per_tick.store(double(wall.count()) / ticks);
+  }
+#endif
+}
+
+// Kick off a thread which periodically samples all threads, or set things up
+// so that threads sample themselves.
+// Threads which have already used Lurien before this is called will not be
+// sampled by the signal backend.
+// This throws std::runtime_error if Options::server_socket_path is set and
+// can't be listened on.
+inline void Init(
+  std::unique_ptr<OutputReceiver> receiver,
+  const Options& options = {})
+{
+  InternalWork internal;
+  if (!Ext::receiver)
+  {
+#if defined(__linux__)
+    if (!options.server_socket_path.empty())
+    {
+      Ext::server.Start(options.server_socket_path);
+    }
+#endif
+
+    Ext::options = options;
+    Ext::receiver = std::move(receiver);
+    {
+      std::lock_guard<std::mutex> lk(Ext::enabled_sync);
+      Ext::enabled_requested = !options.start_paused;
+      PublishEnabled();
+    }
+
+    if (options.trace_output)
+    {
+      Ext::trace.Start(*options.trace_output);
+    }
+
+#if defined(__linux__)
+    const bool signal_backend = options.backend == SamplingBackend::Signal;
+    // Threads arm their timers as soon as they see the options, and SIGPROF
+    // kills the process unless it is handled by then.
+    if (signal_backend)
+    {
+      InstallSamplingSignalHandler();
+    }
+#else
+    const bool signal_backend = false;
+#endif
+
+    // The signal backend only needs a sampling thread to drain the trace.
+    const std::size_t shards = !signal_backend
+      ? std::max<std::size_t>(options.sampling_threads, 1)
+      : options.trace_output ? 1 : 0;
+    {
+      auto lk = LockSamplers();
+      for (std::size_t shard = 0; shard < shards; shard++)
+      {
+        Ext::sampler_shards.push_back(std::make_unique<SamplerShard>());
+      }
+
+      for (const auto& sampler : *Ext::samplers.load())
+      {
+        AddToShard(sampler);
+      }
+    }
+
+    Ext::active_options.store(&Ext::options, std::memory_order_release);
+
+    // Ticks are only converted to nanoseconds when outputs are built, so
+    // threads can start timing scopes before this finishes.
+    CalibrateTimestamps();
+
+    {
+      std::lock_guard<std::mutex> lk(Ext::reporter_sync);
+      Ext::reporting = true;
+    }
+
+    Ext::reporting_worker = std::make_unique<std::thread>(
+      &details::ReportOutputs);
+
+#if defined(__linux__)
+    if (!options.server_socket_path.empty())
+    {
+      Ext::server_worker = std::make_unique<std::thread>(
+        &ProfileServer::Serve, &Ext::server);
+    }
+#endif
+
+    for (std::size_t shard = 0; shard < shards; shard++)
+    {
+      Ext::sampling_workers.emplace_back(&details::TakeSamples, shard);
+    }
+  }
+}
+
+// Stop sampling.
+inline void Stop()
+{
+  InternalWork internal;
+  if (Ext::keep_sampling && Ext::receiver)
+  {
+    {
+      std::lock_guard<std::mutex> lk(Ext::reporter_sync);
+      Ext::keep_sampling = false;
+      Ext::reporting = false;
+    }
+
+    Ext::reporter_wakeup.notify_all();
+#if defined(__linux__)
+    Ext::server_wakeup.notify_all();
+#endif
 
-struct OutputNode
+    if (Ext::reporting_worker)
+    {
+      Ext::reporting_worker->join();
+    }
+
+    for (auto& worker : Ext::sampling_workers)
+    {
+      worker.join();
+    }
+
+#if defined(__linux__)
+    if (Ext::server_worker)
+    {
+      Ext::server_worker->join();
+      Ext::server.Stop();
+    }
+#endif
+
+    Ext::trace.Finish(*Ext::samplers.load());
+  }
+}
+
+// This object updates the thread local data when it is constructed and
+// destructed.
+class Scope
 {
-  std::list<ScopeOutput> scope_outputs_;
+public:
+  inline Scope(std::uint32_t name_id);
+  inline ~Scope();
+
+private:
+  ScopeState state_ = ScopeState::Skipped;
 };
 
-struct ScopeOutput : OutputNode
+// LURIEN_SCOPE registers the name once for each call site.
+inline Scope::Scope(std::uint32_t name_id)
 {
-  std::string name_;
-  std::uint64_t samples_;
-  double cpu_proportion_;
-};
+  // When recording is paused this is the only cost.
+  if (Ext::enabled.load(std::memory_order_relaxed)) [[likely]]
+  {
+    state_ = Ext::thread_data->EnterFiltered(name_id);
+  }
+}
 
-struct ThreadOutput : OutputNode
+inline Scope::~Scope()
 {
-  std::thread::id thread_id_;
-};
+  if (state_ != ScopeState::Skipped)
+  {
+    Ext::thread_data->ExitFiltered(state_);
+  }
+}
 
-struct OutputReceiver
+inline void SetThreadName(std::string name)
 {
-public:
-  virtual ~OutputReceiver() = default;
-  virtual void HandleOutput(
-    const ThreadOutput&) const = 0;
-};
+  Ext::thread_data->SetName(std::move(name));
+}
 
-// This is the default receiver implementation which writes to an std::ostream.
-class DefaultOutputReceiver : public OutputReceiver
+inline void SetThreadTag(std::string key, std::string value)
+{
+  Ext::thread_data->SetTag(std::move(key), std::move(value));
+}
+
+// As Scope, but this also measures the exact time spent in the scope.
+class TimedScope
 {
 public:
-  DefaultOutputReceiver(std::ostream& out) : out_(out) {}
-  inline void HandleOutput(
-    const ThreadOutput& output) const;
+  inline TimedScope(std::uint32_t name_id);
+  inline ~TimedScope();
 
 private:
-  std::ostream& out_;
-  mutable std::mutex output_sync_;
-
-  inline void PrintSubtree(
-    const ScopeOutput& scope,
-    int depth) const;
+  ScopeState state_ = ScopeState::Skipped;
+  std::uint64_t start_ = 0;
 };
 
-inline void DefaultOutputReceiver::HandleOutput(
-  const ThreadOutput& output) const
+inline TimedScope::TimedScope(std::uint32_t name_id)
 {
-  std::lock_guard<std::mutex> lk(output_sync_);
-
-  out_ << std::hex << std::showbase;
-  out_ << "Thread ID: " << output.thread_id_ << std::endl;
-  out_ << std::dec << std::noshowbase;
-
-  // Recursively print the output data.
-  for (const auto& child : output.scope_outputs_)
+  if (Ext::enabled.load(std::memory_order_relaxed)) [[likely]]
   {
-    PrintSubtree(child, 0);
+    state_ = Ext::thread_data->EnterFiltered(name_id);
+    start_ = Ext::thread_data->Timestamp();
   }
 }
 
-inline void DefaultOutputReceiver::PrintSubtree(
-  const ScopeOutput& scope,
-  int depth) const
+inline TimedScope::~TimedScope()
 {
-  out_ << std::string(2*depth, ' ')
-       << scope.name_ << " "
-       << scope.cpu_proportion_ << std::endl;
-
-  for (const auto& child : scope.scope_outputs_)
+  if (state_ == ScopeState::Entered)
+  {
+    Ext::thread_data->ExitTimed(start_);
+  }
+  else if (state_ != ScopeState::Skipped)
   {
-    PrintSubtree(child, depth + 1);
+    Ext::thread_data->ExitFiltered(state_);
   }
 }
 
-namespace details
+// A task's profiling context, for work such as coroutines and queued tasks
+// which can move between threads. Attach it on the thread which runs the
+// task and detach it before the task suspends or moves on: the scopes the
+// task is inside are moved onto the running thread's stack while it is
+// attached and saved here while it isn't, so the task's work is attributed
+// to its own scopes on whichever thread runs it and suspended time isn't
+// sampled. Timed scopes inside the task also leave out suspended time.
+//
+// Scopes inside the task must be entered and exited while it is attached,
+// so a suspended coroutine should be resumed, not destroyed, to unwind.
+class TaskContext
 {
+public:
+  TaskContext() = default;
+  TaskContext(const TaskContext&) = delete;
+  TaskContext& operator=(const TaskContext&) = delete;
 
-class ThreadSamplingData;
+  inline void Attach();
+  inline void Detach();
 
-inline std::shared_ptr<ThreadSamplingData> CreateSamplingData();
+private:
+  TaskState state_;
+};
 
-// All variables which need to have external linkage are static members
-// of this struct.
-struct Ext
+inline void TaskContext::Attach()
 {
-  inline static std::atomic<bool> keep_sampling = true;
-  inline static std::unique_ptr<std::thread> sampling_worker;
-  inline static std::mutex sampler_sync;
-  inline static std::vector<std::weak_ptr<ThreadSamplingData>> samplers;
-  inline thread_local static std::shared_ptr<ThreadSamplingData> thread_data =
-    CreateSamplingData();
-  inline static std::unique_ptr<OutputReceiver> receiver;
-};
+  Ext::thread_data->AttachTask(state_);
+}
+
+inline void TaskContext::Detach()
+{
+  Ext::thread_data->DetachTask(state_);
+}
 
-class ThreadSamplingData :
-  public std::enable_shared_from_this<ThreadSamplingData>
+// Attaches a task for the lifetime of this object, e.g. while a task queue
+// runs one task.
+class AttachedTask
 {
 public:
-  inline ThreadSamplingData();
-  inline ~ThreadSamplingData();
-  inline void Update(const std::string& name);
-  inline void TakeSample();
-  
+  AttachedTask(TaskContext& task) : task_(task) { task_.Attach(); }
+  ~AttachedTask() { task_.Detach(); }
+
 private:
-  std::size_t current_scope_hash_;
-  std::uint64_t total_samples_;
-  std::hash<std::string> hash_fn_;
-  std::unordered_map<std::size_t, ScopeOutput*> scope_data_;
-  std::mutex sample_sync_;
-  ScopeOutput* current_scope_ = nullptr;
-  ThreadOutput output_;
+  TaskContext& task_;
 };
 
-inline std::shared_ptr<ThreadSamplingData> CreateSamplingData()
+#if defined(__cpp_impl_coroutine)
+// Wraps an awaitable so that the coroutine's task is detached while it is
+// suspended and attached again on whichever thread resumes it.
+template <typename Awaiter>
+class TaskAwaiter
 {
-  auto sampler = std::make_shared<ThreadSamplingData>();
+public:
+  TaskAwaiter(TaskContext& task, Awaiter&& awaiter)
+  :
+    task_(task),
+    awaiter_(std::forward<Awaiter>(awaiter))
   {
-    std::lock_guard<std::mutex> lk(Ext::sampler_sync);
-    Ext::samplers.push_back(sampler->weak_from_this());
   }
 
-  return sampler;
-}
-
-inline ThreadSamplingData::ThreadSamplingData()
-:
-  current_scope_hash_(0),
-  total_samples_(0)
-{
-}
+  bool await_ready()
+  {
+    return awaiter_.await_ready();
+  }
 
-// This is where the data this thread has accumulated will be output.
-inline ThreadSamplingData::~ThreadSamplingData()
-{
-  std::lock_guard<std::mutex> lk(sample_sync_);
+  template <typename Promise>
+  auto await_suspend(std::coroutine_handle<Promise> handle)
+  {
+    // Once the awaiter has been told to suspend the coroutine may already
+    // be running on another thread, so detach first.
+    task_.Detach();
 
-  output_.thread_id_ = std::this_thread::get_id();
+    using Result = decltype(awaiter_.await_suspend(handle));
+    if constexpr (std::is_same_v<Result, bool>)
+    {
+      const bool suspended = awaiter_.await_suspend(handle);
+      if (!suspended)
+      {
+        task_.Attach();
+      }
 
-  // Accumulate the probabilities so that an outer scope's usage is at
-  // least the sum of its inner scope's usages.
-  std::function<std::uint64_t(ScopeOutput&)> accumulate_stats =
-    [this, &accumulate_stats] (ScopeOutput& parent)
-  {
-    for (ScopeOutput& child : parent.scope_outputs_)
+      return suspended;
+    }
+    else
     {
-      parent.samples_ += accumulate_stats(child);
+      return awaiter_.await_suspend(handle);
     }
+  }
 
-    parent.cpu_proportion_ = double(parent.samples_) / total_samples_;
+  decltype(auto) await_resume()
+  {
+    task_.Attach();
+    return awaiter_.await_resume();
+  }
 
-    return parent.samples_;
-  };
+private:
+  TaskContext& task_;
+  Awaiter awaiter_;
+};
 
-  for (ScopeOutput& child : output_.scope_outputs_)
+template <typename Awaitable>
+decltype(auto) GetAwaiter(Awaitable&& awaitable)
+{
+  if constexpr (requires { awaitable.operator co_await(); })
+  {
+    return std::forward<Awaitable>(awaitable).operator co_await();
+  }
+  else if constexpr (requires { operator co_await(awaitable); })
+  {
+    return operator co_await(std::forward<Awaitable>(awaitable));
+  }
+  else
   {
-    accumulate_stats(child);
+    return std::forward<Awaitable>(awaitable);
   }
+}
 
-  Ext::receiver->HandleOutput(output_);
+// co_await Await(task, awaitable) awaits as usual, keeping the task's
+// scopes with it.
+template <typename Awaitable>
+auto Await(TaskContext& task, Awaitable&& awaitable)
+{
+  using Awaiter = decltype(GetAwaiter(std::forward<Awaitable>(awaitable)));
+  return TaskAwaiter<Awaiter>(
+    task, GetAwaiter(std::forward<Awaitable>(awaitable)));
 }
+#endif
 
-inline void ThreadSamplingData::Update(
-  const std::string& name)
+// Pause or resume recording scopes and taking samples. Scopes which are
+// already active when this changes are unwound as they were entered.
+inline void SetEnabled(bool enabled)
 {
-  std::lock_guard<std::mutex> lk(sample_sync_);
+  std::lock_guard<std::mutex> lk(Ext::enabled_sync);
+  Ext::enabled_requested = enabled;
+  details::PublishEnabled();
+}
 
-  current_scope_hash_ ^= hash_fn_(name);
+inline bool IsEnabled()
+{
+  return Ext::enabled.load(std::memory_order_relaxed);
+}
 
-  if (current_scope_hash_ == 0)
-  {
-    current_scope_ = nullptr;
-  }
-  else if (!scope_data_.contains(current_scope_hash_))
-  {
-    std::size_t parent_hash = current_scope_hash_ ^ hash_fn_(name);
+// Filter out the scope with this name on all threads, from the next time
+// it is entered. FilterMode::None removes the filter.
+inline void SetScopeFilter(std::string_view name, FilterMode mode)
+{
+  details::InternalWork internal;
+  Ext::filters.Set(RegisterScopeName(name), mode);
+}
+
+} // details
 
-    OutputNode* parent = parent_hash == 0
-      ? &output_ : (OutputNode*)scope_data_[parent_hash];
+// Lurien's overhead statistics so far.
+using details::GetStats;
 
-    parent->scope_outputs_.push_back( ScopeOutput { {}, name, 0, 0 });
-    current_scope_ = &parent->scope_outputs_.back();
-    scope_data_.insert( { current_scope_hash_, current_scope_ } );
-  }
-  else
+// Runtime control over what is recorded.
+using details::SetEnabled;
+using details::IsEnabled;
+using details::SetScopeFilter;
+
+// Following tasks between threads.
+using details::TaskContext;
+using details::AttachedTask;
+
+#if not defined(LURIEN_ENABLED)
+#define LURIEN_INIT(...)
+#define LURIEN_STOP
+#define LURIEN_SNAPSHOT
+#define LURIEN_SCOPE(name)
+#define LURIEN_TIMED_SCOPE(name)
+#define LURIEN_THREAD_NAME(name)
+#define LURIEN_THREAD_TAG(key, value)
+#define LURIEN_PAUSE
+#define LURIEN_RESUME
+#define LURIEN_TASK(task)
+#define LURIEN_TASK_ATTACH(task)
+#define LURIEN_TASK_DETACH(task)
+#define LURIEN_AWAIT(task, awaitable) (awaitable)
+
+#else
+
+#define LURIEN_INIT(...) \
+  lurien::details::Init(__VA_ARGS__);
+
+#define LURIEN_STOP \
+  lurien::details::Stop();
+
+#define LURIEN_SNAPSHOT \
+  lurien::details::Snapshot();
+
+// The name is registered the first time each call site runs.
+#define LURIEN_TIMED_SCOPE(name) \
+  static const std::uint32_t lurien_name_##name = \
+    lurien::details::RegisterScopeName(#name); \
+  lurien::details::TimedScope scope_##name(lurien_name_##name);
+
+#define LURIEN_THREAD_NAME(name) \
+  lurien::details::SetThreadName(name);
+#define LURIEN_THREAD_TAG(key, value) \
+  lurien::details::SetThreadTag(key, value);
+
+#define LURIEN_PAUSE \
+  lurien::details::SetEnabled(false);
+#define LURIEN_RESUME \
+  lurien::details::SetEnabled(true);
+
+#define LURIEN_TASK(task) \
+  lurien::details::TaskContext task; \
+  lurien::details::AttachedTask task##_attached(task);
+#define LURIEN_TASK_ATTACH(task) \
+  (task).Attach();
+#define LURIEN_TASK_DETACH(task) \
+  (task).Detach();
+#define LURIEN_AWAIT(task, awaitable) \
+  lurien::details::Await(task, awaitable)
+
+// Defining LURIEN_TIMING makes every scope a timed scope.
+#if defined(LURIEN_TIMING)
+#define LURIEN_SCOPE(name) LURIEN_TIMED_SCOPE(name)
+#else
+#define LURIEN_SCOPE(name) \
+  static const std::uint32_t lurien_name_##name = \
+    lurien::details::RegisterScopeName(#name); \
+  lurien::details::Scope scope_##name(lurien_name_##name);
+#endif
+
+#endif
+
+} // lurien
+
+// Defining LURIEN_ALLOCATION_HOOKS in exactly one translation unit, along
+// with LURIEN_ENABLED, replaces the global operator new and delete there so
+// that allocations are counted against the scope each thread is in.
+#if defined(LURIEN_ENABLED) && defined(LURIEN_ALLOCATION_HOOKS)
+namespace lurien::details
+{
+
+inline void CountAllocation(std::size_t size)
+{
+  ThreadSamplingData* data = Ext::allocation_target;
+  if (data != nullptr
+   && !Ext::internal_work
+   && Ext::enabled.load(std::memory_order_relaxed))
   {
-    current_scope_ = scope_data_[current_scope_hash_];
+    data->RecordAllocation(size);
   }
 }
 
-inline void ThreadSamplingData::TakeSample()
+inline void CountDeallocation(void* pointer)
 {
-  std::lock_guard<std::mutex> lk(sample_sync_);
-  if (current_scope_ != nullptr)
+  ThreadSamplingData* data = Ext::allocation_target;
+  if (pointer != nullptr
+   && data != nullptr
+   && !Ext::internal_work
+   && Ext::enabled.load(std::memory_order_relaxed))
   {
-    ++current_scope_->samples_;
+    data->RecordDeallocation();
   }
-
-  ++total_samples_;
 }
 
-inline void TakeSamples()
+// As the standard operator new, other than counting the allocation.
+inline void* Allocate(std::size_t size, std::size_t alignment, bool nothrow)
 {
-  while (Ext::keep_sampling)
+  size = std::max<std::size_t>(size, 1);
+  for (;;)
   {
-    std::lock_guard<std::mutex> lk(Ext::sampler_sync);
-    for (auto& sampler : Ext::samplers)
+    void* pointer = alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__
+      ? std::aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1))
+      : std::malloc(size);
+    if (pointer != nullptr)
+    {
+      CountAllocation(size);
+      return pointer;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr)
     {
-      auto shared_sampler = sampler.lock();
-      if (shared_sampler)
+      if (nothrow)
       {
-        shared_sampler->TakeSample();
+        return nullptr;
       }
+
+      throw std::bad_alloc();
     }
+
+    handler();
   }
 }
 
-// Kick off a thread which periodically samples all threads.
-inline void Init(std::unique_ptr<OutputReceiver> receiver)
+inline void Deallocate(void* pointer)
+{
+  CountDeallocation(pointer);
+  std::free(pointer);
+}
+
+} // lurien::details
+
+void* operator new(std::size_t size)
+{
+  return lurien::details::Allocate(size, 0, false);
+}
+
+void* operator new[](std::size_t size)
+{
+  return lurien::details::Allocate(size, 0, false);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
 {
-  if (!Ext::sampling_worker)
+  try
   {
-    Ext::receiver = std::move(receiver);
-    Ext::sampling_worker = std::make_unique<std::thread>(
-      &details::TakeSamples);
+    return lurien::details::Allocate(size, 0, true);
+  }
+  catch (...)
+  {
+    return nullptr;
   }
 }
 
-// Stop sampling.
-inline void Stop()
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+  return lurien::details::Allocate(size, std::size_t(alignment), false);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
 {
-  if (Ext::keep_sampling && Ext::sampling_worker)
+  return lurien::details::Allocate(size, std::size_t(alignment), false);
+}
+
+void* operator new(
+  std::size_t size,
+  std::align_val_t alignment,
+  const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return lurien::details::Allocate(size, std::size_t(alignment), true);
+  }
+  catch (...)
   {
-    Ext::keep_sampling = false;
-    Ext::sampling_worker->join();
+    return nullptr;
   }
 }
 
-// This object updates the thread local data when it is constructed and
-// destructed.
-class Scope
+void* operator new[](
+  std::size_t size,
+  std::align_val_t alignment,
+  const std::nothrow_t&) noexcept
 {
-public:
-  inline Scope(const std::string& name);
-  inline ~Scope();
+  return operator new(size, alignment, std::nothrow);
+}
 
-private:
-  std::string name_;
-};
+void operator delete(void* pointer) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-inline Scope::Scope(
-  const std::string& name)
-:
-  name_(name)
+void operator delete[](void* pointer) noexcept
 {
-  Ext::thread_data->Update(name);
+  lurien::details::Deallocate(pointer);
 }
 
-inline Scope::~Scope()
+void operator delete(void* pointer, std::size_t) noexcept
 {
-  Ext::thread_data->Update(name_);
+  lurien::details::Deallocate(pointer);
 }
 
-} // details
+void operator delete[](void* pointer, std::size_t) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-#if not defined(LURIEN_ENABLED)
-#define LURIEN_INIT(receiver)
-#define LURIEN_STOP
-#define LURIEN_SCOPE(name)
+void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-#else
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-#define LURIEN_INIT(receiver) \
-  lurien::details::Init(receiver);
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-#define LURIEN_STOP \
-  lurien::details::Stop();
+void operator delete[](void* pointer, std::align_val_t) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-#define LURIEN_SCOPE(name) \
-  lurien::details::Scope scope_##name(#name);
+void operator delete(
+  void* pointer,
+  std::size_t,
+  std::align_val_t) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-#endif
+void operator delete[](
+  void* pointer,
+  std::size_t,
+  std::align_val_t) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
 
-} // lurien
+void operator delete(
+  void* pointer,
+  std::align_val_t,
+  const std::nothrow_t&) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
+
+void operator delete[](
+  void* pointer,
+  std::align_val_t,
+  const std::nothrow_t&) noexcept
+{
+  lurien::details::Deallocate(pointer);
+}
+#endif
 
 #endif // __LURIEN_PROFILER_H__
@@ -0,0 +1,88 @@
+// Converts a profile written by lurien::BinaryOutputReceiver into one of the
+// text formats, writing it to stdout.
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <variant>
+
+#include "lurien/lurien.h"
+
+namespace
+{
+
+void PrintUsage()
+{
+  std::cerr << "Usage: lurien_convert <text|collapsed|pprof> <profile>\n";
+}
+
+std::unique_ptr<lurien::OutputReceiver> MakeReceiver(const char* format)
+{
+  if (std::strcmp(format, "text") == 0)
+  {
+    return std::make_unique<lurien::DefaultOutputReceiver>(std::cout);
+  }
+
+  if (std::strcmp(format, "collapsed") == 0)
+  {
+    return std::make_unique<lurien::CollapsedStackOutputReceiver>(std::cout);
+  }
+
+  if (std::strcmp(format, "pprof") == 0)
+  {
+    return std::make_unique<lurien::PprofOutputReceiver>(std::cout);
+  }
+
+  return nullptr;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  if (argc != 3)
+  {
+    PrintUsage();
+    return 1;
+  }
+
+  auto receiver = MakeReceiver(argv[1]);
+  if (!receiver)
+  {
+    PrintUsage();
+    return 1;
+  }
+
+  std::ifstream in(argv[2], std::ios::binary);
+  if (!in)
+  {
+    std::cerr << "Could not open " << argv[2] << "\n";
+    return 1;
+  }
+
+  try
+  {
+    // Outputs are replayed in the order they were written, so snapshots
+    // stay between the thread exits they were taken between.
+    for (const auto& output : lurien::ReadBinaryProfile(in))
+    {
+      if (const auto* thread = std::get_if<lurien::ThreadOutput>(&output))
+      {
+        receiver->HandleOutput(*thread);
+      }
+      else
+      {
+        receiver->HandleAggregateOutput(
+          std::get<lurien::AggregateOutput>(output));
+      }
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << argv[2] << ": " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,231 @@
+// Compares two profiles written by lurien::BinaryOutputReceiver, merging
+// each file's threads by scope path and reporting how every path's share of
+// the samples changed, largest regression first. The exit code is non-zero
+// if a path's share grew by more than a threshold, so that this can gate a
+// build on the shape of a profile.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "lurien/lurien.h"
+
+namespace
+{
+
+// The exit code when a threshold is exceeded, so that it can be told apart
+// from a usage or input error.
+constexpr int kRegression = 2;
+
+void PrintUsage()
+{
+  std::cerr << "Usage: lurien_diff [--inclusive-threshold <percent>] "
+               "[--self-threshold <percent>] <baseline> <profile>\n";
+}
+
+struct PathCounts
+{
+  std::uint64_t self_samples_ = 0;
+  std::uint64_t inclusive_samples_ = 0;
+  double self_proportion_ = 0;
+  double cpu_proportion_ = 0;
+};
+
+struct PathDelta
+{
+  std::string path_;
+  PathCounts baseline_;
+  PathCounts profile_;
+
+  // Changes in percentage points of all samples.
+  double self_change_;
+  double inclusive_change_;
+};
+
+using Paths = std::map<std::string, PathCounts>;
+
+void AddPaths(
+  const std::list<lurien::AggregateScopeOutput>& scopes,
+  const std::string& prefix,
+  Paths& paths)
+{
+  for (const auto& scope : scopes)
+  {
+    const std::string path =
+      prefix.empty() ? scope.name_ : prefix + ";" + scope.name_;
+    paths[path] = PathCounts {
+      scope.self_samples_,
+      scope.inclusive_samples_,
+      scope.self_proportion_,
+      scope.cpu_proportion_ };
+    AddPaths(scope.scope_outputs_, path, paths);
+  }
+}
+
+// Every thread and aggregate in the file is merged, so the file should hold
+// either the threads' exit output or their snapshots but not both.
+bool ReadPaths(const char* file, Paths& paths)
+{
+  std::ifstream in(file, std::ios::binary);
+  if (!in)
+  {
+    std::cerr << "Could not open " << file << "\n";
+    return false;
+  }
+
+  lurien::Aggregator aggregator;
+  try
+  {
+    for (const auto& output : lurien::ReadBinaryProfile(in))
+    {
+      std::visit(
+        [&aggregator] (const auto& each) { aggregator.Add(each); }, output);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << file << ": " << e.what() << "\n";
+    return false;
+  }
+
+  const auto result = aggregator.Result(lurien::OutputKind::ThreadExit);
+  if (result.total_samples_ == 0)
+  {
+    std::cerr << file << ": No samples\n";
+    return false;
+  }
+
+  AddPaths(result.scope_outputs_, "", paths);
+  return true;
+}
+
+bool ParsePercent(const char* text, double& value)
+{
+  char* end;
+  value = std::strtod(text, &end);
+  return end != text && *end == '\0' && value >= 0;
+}
+
+// Sample counts are printed alongside their changes since proportions alone
+// hide whether a path grew or everything else shrank.
+void PrintDelta(const PathDelta& delta)
+{
+  auto change = [] (std::uint64_t before, std::uint64_t after)
+  {
+    return static_cast<long long>(after) - static_cast<long long>(before);
+  };
+
+  char line[256];
+  std::snprintf(
+    line,
+    sizeof(line),
+    "%+8.2f %+8.2f %8.2f %8.2f %10llu %10llu %+10lld %10llu %10llu %+10lld  ",
+    delta.inclusive_change_,
+    delta.self_change_,
+    100*delta.baseline_.cpu_proportion_,
+    100*delta.profile_.cpu_proportion_,
+    static_cast<unsigned long long>(delta.baseline_.inclusive_samples_),
+    static_cast<unsigned long long>(delta.profile_.inclusive_samples_),
+    change(
+      delta.baseline_.inclusive_samples_, delta.profile_.inclusive_samples_),
+    static_cast<unsigned long long>(delta.baseline_.self_samples_),
+    static_cast<unsigned long long>(delta.profile_.self_samples_),
+    change(delta.baseline_.self_samples_, delta.profile_.self_samples_));
+  std::cout << line << delta.path_ << "\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  double inclusive_threshold = -1;
+  double self_threshold = -1;
+
+  int arg = 1;
+  for (; arg + 1 < argc && std::strncmp(argv[arg], "--", 2) == 0; arg += 2)
+  {
+    double* threshold = nullptr;
+    if (std::strcmp(argv[arg], "--inclusive-threshold") == 0)
+    {
+      threshold = &inclusive_threshold;
+    }
+    else if (std::strcmp(argv[arg], "--self-threshold") == 0)
+    {
+      threshold = &self_threshold;
+    }
+
+    if (!threshold || !ParsePercent(argv[arg + 1], *threshold))
+    {
+      PrintUsage();
+      return 1;
+    }
+  }
+
+  if (argc - arg != 2)
+  {
+    PrintUsage();
+    return 1;
+  }
+
+  Paths baseline;
+  Paths profile;
+  if (!ReadPaths(argv[arg], baseline) || !ReadPaths(argv[arg + 1], profile))
+  {
+    return 1;
+  }
+
+  // Paths which only appear in one profile count as zero in the other.
+  std::map<std::string, std::pair<PathCounts, PathCounts>> merged;
+  for (const auto& [path, counts] : baseline)
+  {
+    merged[path].first = counts;
+  }
+
+  for (const auto& [path, counts] : profile)
+  {
+    merged[path].second = counts;
+  }
+
+  std::vector<PathDelta> deltas;
+  for (const auto& [path, counts] : merged)
+  {
+    const auto& [before, after] = counts;
+    deltas.push_back(PathDelta {
+      path,
+      before,
+      after,
+      100*(after.self_proportion_ - before.self_proportion_),
+      100*(after.cpu_proportion_ - before.cpu_proportion_) });
+  }
+
+  std::stable_sort(
+    deltas.begin(),
+    deltas.end(),
+    [] (const PathDelta& a, const PathDelta& b)
+    {
+      return a.inclusive_change_ > b.inclusive_change_;
+    });
+
+  std::cout << " +incl%   +self%    base%    prof%  base incl  prof incl"
+               "      +incl  base self  prof self      +self  path\n";
+
+  bool regressed = false;
+  for (const auto& delta : deltas)
+  {
+    PrintDelta(delta);
+    regressed = regressed
+      || (inclusive_threshold >= 0
+       && delta.inclusive_change_ > inclusive_threshold)
+      || (self_threshold >= 0 && delta.self_change_ > self_threshold);
+  }
+
+  return regressed ? kRegression : 0;
+}